@@ -0,0 +1,37 @@
+# This file is part of gpu-bake, a library for baking texture maps on GPUs.
+#
+# Copyright (C) 2015 Christoph Heindl <christoph.heindl@gmail.com>
+#
+# This Source Code Form is subject to the terms of the BSD 3 license.
+# If a copy of the BSD was not distributed with this file, You can obtain
+# one at http://opensource.org/licenses/BSD-3-Clause.
+
+# Embeds OpenCL kernel sources as null-terminated byte arrays.
+#
+# Invoked in script mode:
+#   cmake -DKERNEL_FILES="a.cl;b.cl" -DOUTPUT=kernel_sources.h -P embed_kernels.cmake
+#
+# For each file 'name.cl' a constant 'bake::opencl::kernels::name' is generated.
+# Sources are hex encoded to avoid escaping issues and string literal length limits.
+
+set(content "// Generated by embed_kernels.cmake. Do not edit.\n\n")
+set(content "${content}#ifndef BAKE_OPENCL_KERNEL_SOURCES\n#define BAKE_OPENCL_KERNEL_SOURCES\n\n")
+set(content "${content}namespace bake {\n    namespace opencl {\n        namespace kernels {\n")
+
+foreach(file ${KERNEL_FILES})
+    get_filename_component(name ${file} NAME_WE)
+    file(READ ${file} hex HEX)
+    string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," hex "${hex}")
+    string(REGEX REPLACE "(0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,)" "\\1\n                " hex "${hex}")
+    set(content "${content}\n            const unsigned char ${name}[] = {\n                ${hex}0x00\n            };\n")
+endforeach()
+
+set(content "${content}\n        }\n    }\n}\n\n#endif\n")
+
+# Only touch the output when the content changed to avoid needless rebuilds.
+if (EXISTS ${OUTPUT})
+    file(READ ${OUTPUT} previous)
+endif ()
+if (NOT "${previous}" STREQUAL "${content}")
+    file(WRITE ${OUTPUT} "${content}")
+endif ()
@@ -0,0 +1,285 @@
+// This file is part of gpu-bake, a library for baking texture maps on GPUs.
+//
+// Copyright (C) 2015 Christoph Heindl <christoph.heindl@gmail.com>
+//
+// This Source Code Form is subject to the terms of the BSD 3 license.
+// If a copy of the BSD was not distributed with this file, You can obtain
+// one at http://opensource.org/licenses/BSD-3-Clause.
+
+#include "catch.hpp"
+
+#include <bake/geometry.h>
+#include <algorithm>
+#include <random>
+#include <set>
+
+namespace {
+    
+    /** Surface of given triangles, vertices as columns of consecutive triples. */
+    bake::Surface makeSurface(const std::vector<Eigen::Vector3f> &vertices)
+    {
+        bake::Surface s;
+        s.vertexPositions.resize(4, vertices.size());
+        for (size_t i = 0; i < vertices.size(); ++i) {
+            s.vertexPositions.col(i) = vertices[i].homogeneous();
+        }
+        return s;
+    }
+    
+    /** Random triangles with edges up to size, half of them clustered in a small corner when clustered is set. */
+    bake::Surface randomSurface(int nTriangles, float size, bool clustered, unsigned seed)
+    {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> u(0.f, 1.f);
+        
+        std::vector<Eigen::Vector3f> vertices;
+        for (int i = 0; i < nTriangles; ++i) {
+            const float scale = (clustered && i % 2 == 0) ? 0.05f : 1.f;
+            const Eigen::Vector3f a(u(rng) * scale, u(rng) * scale, u(rng) * scale);
+            for (int j = 0; j < 3; ++j) {
+                vertices.push_back(a + Eigen::Vector3f(u(rng), u(rng), u(rng)) * size * scale);
+            }
+        }
+        return makeSurface(vertices);
+    }
+    
+    /** Random point on triangle tri. */
+    Eigen::Vector3f randomPoint(const bake::Surface &s, int tri, std::mt19937 &rng)
+    {
+        std::uniform_real_distribution<float> u(0.f, 1.f);
+        float a = u(rng);
+        float b = u(rng);
+        if (a + b > 1.f) {
+            a = 1.f - a;
+            b = 1.f - b;
+        }
+        
+        const Eigen::Vector3f p0 = s.vertexPositions.col(tri * 3 + 0).head<3>();
+        const Eigen::Vector3f p1 = s.vertexPositions.col(tri * 3 + 1).head<3>();
+        const Eigen::Vector3f p2 = s.vertexPositions.col(tri * 3 + 2).head<3>();
+        return p0 + a * (p1 - p0) + b * (p2 - p0);
+    }
+    
+    /** Voxel containing p, clamped to the grid. */
+    Eigen::Vector3i voxelOf(const bake::SurfaceVolume &v, const Eigen::Vector3f &p)
+    {
+        const Eigen::Vector3f l = v.toVoxel * p;
+        Eigen::Vector3i idx;
+        for (int i = 0; i < 3; ++i) {
+            idx[i] = std::max(0, std::min(static_cast<int>(std::floor(l[i])), v.voxelsPerDimension[i] - 1));
+        }
+        return idx;
+    }
+    
+    int cellIndex(const Eigen::Vector3i &idx, const Eigen::Vector3i &res)
+    {
+        return idx.x() + idx.y() * res.x() + idx.z() * res.x() * res.y();
+    }
+    
+    /** Triangles of the list starting at first, up to its terminator. */
+    std::set<int> cellTriangles(const bake::SurfaceVolume &v, int first)
+    {
+        std::set<int> tris;
+        for (int i = first; v.triangleIndices[i] != -1; ++i) {
+            tris.insert(v.triangleIndices[i]);
+        }
+        return tris;
+    }
+    
+    /** Triangles listed for point p, descending into sub-grids of two-level grids. */
+    std::set<int> lookup(const bake::SurfaceVolume &v, const Eigen::Vector3f &p)
+    {
+        const Eigen::Vector3i voxel = voxelOf(v, p);
+        const int c = v.cells[cellIndex(voxel, v.voxelsPerDimension)];
+        if (c >= 0) {
+            return cellTriangles(v, c);
+        }
+        
+        const int header = -c - 1;
+        const Eigen::Vector3i subRes(v.cells[header], v.cells[header + 1], v.cells[header + 2]);
+        const Eigen::Vector3f l = (v.toVoxel * p - voxel.cast<float>()).cwiseProduct(subRes.cast<float>());
+        Eigen::Vector3i sub;
+        for (int i = 0; i < 3; ++i) {
+            sub[i] = std::max(0, std::min(static_cast<int>(std::floor(l[i])), subRes[i] - 1));
+        }
+        return cellTriangles(v, v.cells[header + 3 + cellIndex(sub, subRes)]);
+    }
+    
+    /** Triangles listed anywhere within top-level cell idx. */
+    std::set<int> voxelTriangles(const bake::SurfaceVolume &v, int idx)
+    {
+        const int c = v.cells[idx];
+        if (c >= 0) {
+            return cellTriangles(v, c);
+        }
+        
+        const int header = -c - 1;
+        const int nSub = v.cells[header] * v.cells[header + 1] * v.cells[header + 2];
+        std::set<int> tris;
+        for (int i = 0; i < nSub; ++i) {
+            const std::set<int> s = cellTriangles(v, v.cells[header + 3 + i]);
+            tris.insert(s.begin(), s.end());
+        }
+        return tris;
+    }
+    
+}
+
+TEST_CASE("surface_volume_layout")
+{
+    // Two voxels along x. Triangle 0 lies in the first, 2 in the second and 1 spans both.
+    std::vector<Eigen::Vector3f> vertices = {
+        Eigen::Vector3f(0.1f, 0.1f, 0.1f), Eigen::Vector3f(0.4f, 0.1f, 0.1f), Eigen::Vector3f(0.1f, 0.4f, 0.1f),
+        Eigen::Vector3f(0.f, 0.f, 0.f), Eigen::Vector3f(2.f, 1.f, 1.f), Eigen::Vector3f(0.2f, 0.1f, 0.9f),
+        Eigen::Vector3f(1.6f, 0.9f, 0.9f), Eigen::Vector3f(1.9f, 0.9f, 0.9f), Eigen::Vector3f(2.f, 1.f, 1.f),
+    };
+    
+    bake::SurfaceVolume v;
+    REQUIRE(bake::buildSurfaceVolume(makeSurface(vertices), Eigen::Vector3i(2, 1, 1), v));
+    
+    const int cells[] = {0, 3};
+    const int tris[] = {0, 1, -1, 1, 2, -1};
+    REQUIRE(std::vector<int>(v.cells.begin(), v.cells.end()) == std::vector<int>(cells, cells + 2));
+    REQUIRE(std::vector<int>(v.triangleIndices.begin(), v.triangleIndices.end()) == std::vector<int>(tris, tris + 6));
+    
+    // Lists are consecutive, sorted and terminated.
+    bake::SurfaceVolume r;
+    REQUIRE(bake::buildSurfaceVolume(randomSurface(500, 0.2f, false, 1), Eigen::Vector3i(7, 5, 3), r));
+    REQUIRE(r.cells.size() == 7 * 5 * 3);
+    REQUIRE(r.cells[0] == 0);
+    for (size_t idx = 0; idx < r.cells.size(); ++idx) {
+        int i = r.cells[idx];
+        while (r.triangleIndices[i] != -1) {
+            REQUIRE(r.triangleIndices[i] >= 0);
+            REQUIRE(r.triangleIndices[i] < 500);
+            if (r.triangleIndices[i + 1] != -1) {
+                REQUIRE(r.triangleIndices[i] < r.triangleIndices[i + 1]);
+            }
+            ++i;
+        }
+        const int next = (idx + 1 < r.cells.size()) ? r.cells[idx + 1] : static_cast<int>(r.triangleIndices.size());
+        REQUIRE(next == i + 1);
+    }
+}
+
+TEST_CASE("surface_volume_threads")
+{
+    const bake::Surface s = randomSurface(3000, 0.1f, true, 2);
+    const Eigen::Vector3i res(13, 7, 5);
+    
+    bake::SurfaceVolume serial;
+    REQUIRE(bake::buildSurfaceVolume(s, res, serial, 1));
+    
+    for (int threads = 2; threads <= 8; threads += 3) {
+        bake::SurfaceVolume parallel;
+        REQUIRE(bake::buildSurfaceVolume(s, res, parallel, threads));
+        REQUIRE(parallel.cells == serial.cells);
+        REQUIRE(parallel.triangleIndices == serial.triangleIndices);
+    }
+    
+    bake::SurfaceVolume twoLevelSerial, twoLevelParallel;
+    REQUIRE(bake::buildTwoLevelSurfaceVolume(s, res, 2.f, twoLevelSerial, 1));
+    REQUIRE(bake::buildTwoLevelSurfaceVolume(s, res, 2.f, twoLevelParallel, 5));
+    REQUIRE(twoLevelParallel.cells == twoLevelSerial.cells);
+    REQUIRE(twoLevelParallel.triangleIndices == twoLevelSerial.triangleIndices);
+}
+
+TEST_CASE("surface_volume_overlap")
+{
+    // The overlap test must never drop a voxel containing a point of the triangle.
+    const bake::Surface s = randomSurface(400, 0.3f, false, 3);
+    
+    bake::SurfaceVolume v;
+    REQUIRE(bake::buildSurfaceVolume(s, Eigen::Vector3i(16, 16, 16), v));
+    
+    std::mt19937 rng(4);
+    for (int tri = 0; tri < 400; ++tri) {
+        for (int i = 0; i < 64; ++i) {
+            const Eigen::Vector3f p = randomPoint(s, tri, rng);
+            REQUIRE(lookup(v, p).count(tri) == 1);
+        }
+    }
+    
+    // Triangles crossing many voxels are culled from voxels only their bounds overlap.
+    size_t nReferences = v.triangleIndices.size() - v.cells.size();
+    size_t nBoxReferences = 0;
+    for (int tri = 0; tri < 400; ++tri) {
+        Eigen::AlignedBox3i box;
+        for (int j = 0; j < 3; ++j) {
+            box.extend(voxelOf(v, s.vertexPositions.col(tri * 3 + j).head<3>()));
+        }
+        nBoxReferences += (box.sizes() + Eigen::Vector3i::Ones()).prod();
+    }
+    REQUIRE(nReferences < nBoxReferences);
+}
+
+TEST_CASE("choose_voxels_per_dimension")
+{
+    const Eigen::AlignedBox3f cube(Eigen::Vector3f::Zero(), Eigen::Vector3f::Ones());
+    REQUIRE(bake::chooseVoxelsPerDimension(cube, 2000, 2.f) == Eigen::Vector3i(10, 10, 10));
+    
+    // Voxels stay cubic for elongated bounds.
+    const Eigen::AlignedBox3f bar(Eigen::Vector3f::Zero(), Eigen::Vector3f(100.f, 1.f, 1.f));
+    REQUIRE(bake::chooseVoxelsPerDimension(bar, 200, 2.f) == Eigen::Vector3i(100, 1, 1));
+    
+    // Clamped to [1, maxPerDimension].
+    REQUIRE(bake::chooseVoxelsPerDimension(cube, 1000000000, 2.f) == Eigen::Vector3i(256, 256, 256));
+    REQUIRE(bake::chooseVoxelsPerDimension(cube, 1000000000, 2.f, 32) == Eigen::Vector3i(32, 32, 32));
+    const Eigen::AlignedBox3f needle(Eigen::Vector3f::Zero(), Eigen::Vector3f(1000.f, 0.001f, 0.001f));
+    const Eigen::Vector3i needleRes = bake::chooseVoxelsPerDimension(needle, 10, 2.f);
+    REQUIRE(needleRes.y() == 1);
+    REQUIRE(needleRes.z() == 1);
+    REQUIRE(needleRes.x() >= 1);
+    REQUIRE(needleRes.x() <= 256);
+    
+    // Invalid input falls back to a single voxel.
+    REQUIRE(bake::chooseVoxelsPerDimension(cube, 0, 2.f) == Eigen::Vector3i::Ones());
+    REQUIRE(bake::chooseVoxelsPerDimension(cube, 100, 0.f) == Eigen::Vector3i::Ones());
+    const Eigen::AlignedBox3f flat(Eigen::Vector3f::Zero(), Eigen::Vector3f(1.f, 1.f, 0.f));
+    REQUIRE(bake::chooseVoxelsPerDimension(flat, 100, 2.f) == Eigen::Vector3i::Ones());
+    
+    // Volume bounds of flat surfaces are enlarged, so that they receive a proper grid.
+    std::vector<Eigen::Vector3f> vertices;
+    for (int i = 0; i < 100; ++i) {
+        const float x = static_cast<float>(i % 10);
+        const float y = static_cast<float>(i / 10);
+        vertices.push_back(Eigen::Vector3f(x, y, 0.f));
+        vertices.push_back(Eigen::Vector3f(x + 1.f, y, 0.f));
+        vertices.push_back(Eigen::Vector3f(x, y + 1.f, 0.f));
+    }
+    const Eigen::AlignedBox3f bounds = bake::computeVolumeBounds(makeSurface(vertices).vertexPositions);
+    REQUIRE(bounds.volume() > 0.f);
+    const Eigen::Vector3i res = bake::chooseVoxelsPerDimension(bounds, 100, 2.f);
+    REQUIRE((res.array() >= 1).all());
+    REQUIRE(res.x() > 1);
+    REQUIRE(res.y() > 1);
+}
+
+TEST_CASE("two_level_surface_volume")
+{
+    const bake::Surface s = randomSurface(2000, 0.1f, true, 5);
+    const Eigen::Vector3i res(8, 8, 8);
+    
+    bake::SurfaceVolume uniform, twoLevel;
+    REQUIRE(bake::buildSurfaceVolume(s, res, uniform));
+    REQUIRE(bake::buildTwoLevelSurfaceVolume(s, res, 2.f, twoLevel));
+    
+    // The clustered half of the triangles forces sub-grids.
+    const int nVoxels = res.prod();
+    REQUIRE(std::count_if(twoLevel.cells.begin(), twoLevel.cells.begin() + nVoxels, [](int c) { return c < 0; }) > 0);
+    
+    // Sub-grids together list the triangles of their voxel in the uniform grid.
+    for (int idx = 0; idx < nVoxels; ++idx) {
+        REQUIRE(voxelTriangles(twoLevel, idx) == voxelTriangles(uniform, idx));
+    }
+    
+    // Lookups of points on triangles find the triangle in both grids.
+    std::mt19937 rng(6);
+    for (int tri = 0; tri < 2000; ++tri) {
+        for (int i = 0; i < 16; ++i) {
+            const Eigen::Vector3f p = randomPoint(s, tri, rng);
+            REQUIRE(lookup(uniform, p).count(tri) == 1);
+            REQUIRE(lookup(twoLevel, p).count(tri) == 1);
+        }
+    }
+}
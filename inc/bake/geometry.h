@@ -9,22 +9,98 @@
 #ifndef BAKE_SURFACE
 #define BAKE_SURFACE
 
+#include <bake/page_allocator.h>
 #include <Eigen/Dense>
 #include <vector>
+#include <utility>
 
 namespace bake {
     
+    /**
+        Column major float matrix with a fixed number of rows stored in page aligned memory.
+     
+        Behaves like an Eigen matrix mapped onto its own storage, which is padded to a multiple 
+        of PagePadding, so that devices sharing host memory can use it in place. Resizing 
+        discards the content.
+    */
+    template<int Rows>
+    class PageMatrix : public Eigen::Map< Eigen::Matrix<float, Rows, Eigen::Dynamic, Eigen::ColMajor>, Eigen::Aligned > {
+    public:
+        typedef Eigen::Matrix<float, Rows, Eigen::Dynamic, Eigen::ColMajor> PlainMatrix;
+        typedef Eigen::Map<PlainMatrix, Eigen::Aligned> Base;
+        typedef typename Base::Index Index;
+        
+        /** Create an empty matrix. */
+        PageMatrix() : Base(0, Rows, 0) {}
+        
+        PageMatrix(const PageMatrix &other) : Base(0, Rows, 0) {
+            *this = other;
+        }
+        
+        PageMatrix(PageMatrix &&other) : Base(0, Rows, 0), _storage(std::move(other._storage)) {
+            remap(Rows, other.cols());
+            other.remap(Rows, 0);
+        }
+        
+        template<class Derived>
+        PageMatrix(const Eigen::MatrixBase<Derived> &other) : Base(0, Rows, 0) {
+            *this = other;
+        }
+        
+        PageMatrix &operator=(const PageMatrix &other) {
+            if (this != &other) {
+                resize(other.rows(), other.cols());
+                Base::operator=(other);
+            }
+            return *this;
+        }
+        
+        PageMatrix &operator=(PageMatrix &&other) {
+            if (this != &other) {
+                _storage = std::move(other._storage);
+                remap(Rows, other.cols());
+                other.remap(Rows, 0);
+            }
+            return *this;
+        }
+        
+        template<class Derived>
+        PageMatrix &operator=(const Eigen::MatrixBase<Derived> &other) {
+            PlainMatrix m = other;
+            resize(m.rows(), m.cols());
+            Base::operator=(m);
+            return *this;
+        }
+        
+        /** Resize to given number of columns. Rows need to match the fixed number of rows. */
+        void resize(Index rows, Index cols) {
+            eigen_assert(rows == Rows);
+            _storage.assign(static_cast<size_t>(rows * cols), 0.f);
+            remap(rows, cols);
+        }
+        
+    private:
+        void remap(Index rows, Index cols) {
+            // Placement new is the documented way of changing the array a map refers to.
+            new (static_cast<Base*>(this)) Base(_storage.empty() ? 0 : _storage.data(), rows, cols);
+        }
+        
+        std::vector<float, PageAllocator<float> > _storage;
+    };
+    
     /** 
         Defines a triangulated surface.
      
         Triangles are defines by consecutive triples of matrix columns. This might be improved
         towards lesser memory footprint in future work. 
+     
+        Matrix storage is page aligned, so that devices sharing host memory can use it in place.
     */
     struct Surface {
-        typedef Eigen::Matrix<float, 4, Eigen::Dynamic, Eigen::ColMajor> VertexPositionMatrix;
-        typedef Eigen::Matrix<float, 4, Eigen::Dynamic, Eigen::ColMajor> VertexColorMatrix;
-        typedef Eigen::Matrix<float, 4, Eigen::Dynamic, Eigen::ColMajor> VertexNormalMatrix;
-        typedef Eigen::Matrix<float, 2, Eigen::Dynamic, Eigen::ColMajor> VertexUVMatrix;
+        typedef PageMatrix<4> VertexPositionMatrix;
+        typedef PageMatrix<4> VertexColorMatrix;
+        typedef PageMatrix<4> VertexNormalMatrix;
+        typedef PageMatrix<2> VertexUVMatrix;
         
         VertexPositionMatrix vertexPositions;
         VertexColorMatrix vertexColors;
@@ -37,21 +113,52 @@ namespace bake {
      
         Stores a single index per voxel that represents the first trianlge index in that voxel.
         All triangle indices are considered to be part of the cell until a terminator index is found (-1).
+     
+        Two-level grids subdivide dense voxels further. A negative cell value c then refers to 
+        a sub-grid stored in cells starting at -c - 1: its resolution in x, y and z followed by 
+        its own cells, which span the voxel and index triangles like top-level cells.
+     
+        Index storage is page aligned, so that devices sharing host memory can use it in place.
     */
     struct SurfaceVolume {
+        typedef std::vector<int, PageAllocator<int> > IndexVector;
+        
         Eigen::AlignedBox3f bounds;
         Eigen::Affine3f toVoxel;
         Eigen::Vector3i voxelsPerDimension;
         Eigen::Vector3f voxelSizes;
-        std::vector<int> cells;
-        std::vector<int> triangleIndices;
+        IndexVector cells;
+        IndexVector triangleIndices;
     };
     
     /** Compute an axis aligned bounding box for the given points. */
     Eigen::AlignedBox3f computeBoundingBox(const Surface::VertexPositionMatrix &m);
     
-    /** Builds a uniform grid where each voxel maps to all triangle indices intersecting that voxel. */
-    bool buildSurfaceVolume(const Surface &s, const Eigen::Vector3i &voxelsPerDimension, SurfaceVolume &v);
+    /** Compute the bounds of a grid over the given points. Flat bounds are enlarged to non-zero volume. */
+    Eigen::AlignedBox3f computeVolumeBounds(const Surface::VertexPositionMatrix &m);
+    
+    /** 
+        Choose a grid resolution for nTriangles within bounds.
+     
+        Voxels are made roughly cubic and their number is chosen to hold trianglesPerVoxel 
+        triangles on average. Each axis receives between 1 and maxPerDimension voxels.
+     */
+    Eigen::Vector3i chooseVoxelsPerDimension(const Eigen::AlignedBox3f &bounds, int nTriangles, 
+                                             float trianglesPerVoxel = 2.f, int maxPerDimension = 256);
+    
+    /** 
+        Builds a uniform grid where each voxel maps to all triangle indices intersecting that voxel.
+        Uses the given number of threads, zero chooses automatically. The result does not depend
+        on the number of threads.
+     */
+    bool buildSurfaceVolume(const Surface &s, const Eigen::Vector3i &voxelsPerDimension, SurfaceVolume &v, int threads = 0);
+    
+    /** 
+        Builds a two-level grid. Each voxel of the top-level grid holding more triangles than
+        trianglesPerVoxel allows for is subdivided into a sub-grid sized by its triangle count.
+        Threads are chosen as in buildSurfaceVolume.
+     */
+    bool buildTwoLevelSurfaceVolume(const Surface &s, const Eigen::Vector3i &voxelsPerDimension, float trianglesPerVoxel, SurfaceVolume &v, int threads = 0);
     
 }
 
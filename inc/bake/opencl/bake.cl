@@ -1,4 +1,3 @@
-
 // This file is part of gpu-bake, a library for baking texture maps on GPUs.
 //
 // Copyright (C) 2015 Christoph Heindl <christoph.heindl@gmail.com>
@@ -9,11 +8,203 @@
 
 #pragma OPENCL EXTENSION cl_intel_printf : enable
 
+/**
+    Launch constants. Program variants built with BAKE_IMAGE_SIZE, BAKE_SAMPLES, BAKE_STEP_OUT
+    and BAKE_VOXELS_X/Y/Z defined overwrite the respective kernel arguments with constants,
+    which the compiler then folds into rasterization and traversal code.
+ */
+#ifdef BAKE_IMAGE_SIZE
+#define SPECIALIZE_IMAGE_SIZE(v) v = BAKE_IMAGE_SIZE
+#else
+#define SPECIALIZE_IMAGE_SIZE(v)
+#endif
+
+#ifdef BAKE_SAMPLES
+#define SPECIALIZE_SAMPLES(v) v = BAKE_SAMPLES
+#else
+#define SPECIALIZE_SAMPLES(v)
+#endif
+
+#ifdef BAKE_STEP_OUT
+#define SPECIALIZE_STEP_OUT(v) v = BAKE_STEP_OUT
+#else
+#define SPECIALIZE_STEP_OUT(v)
+#endif
+
+#ifdef BAKE_VOXELS_X
+#define SPECIALIZE_VOXELS(v) v = (int3)(BAKE_VOXELS_X, BAKE_VOXELS_Y, BAKE_VOXELS_Z)
+#else
+#define SPECIALIZE_VOXELS(v)
+#endif
 
-float cross2(float2 a, float2 b) {
-    return a.x*b.y - a.y*b.x;
+/** 
+    Ray from the point of target triangle triId given by barycentric weights w. The ray 
+    starts stepOut above the surface and points against the interpolated normal.
+ */
+void targetRay(
+    int triId,
+    float3 w,
+    __global float3* targetVertexPositions,
+    __global float3* targetVertexNormals,
+    float stepOut,
+    float3 *o,
+    float3 *d)
+{
+    float3 n = normalize(targetVertexNormals[triId*3+0] * w.x + targetVertexNormals[triId*3+1] * w.y + targetVertexNormals[triId*3+2] * w.z);
+    float3 p = targetVertexPositions[triId*3+0] * w.x + targetVertexPositions[triId*3+1] * w.y + targetVertexPositions[triId*3+2] * w.z;
+    
+    *o = p + n * stepOut;
+    *d = -n;
 }
 
+/** 
+    March the source volume along a ray. Returns false on miss, otherwise the closest 
+    source triangle and its hit as (t, alpha, beta).
+ */
+bool traceSource(
+    float3 o,
+    float3 d,
+    __global float3* srcVertexPositions,
+    __global int* srcVoxels,
+    __global int* srcTrianglesInVoxels,
+    float8 srcVoxelBounds,
+    float3 srcVoxelSizes,
+    float3 srcInvVoxelSizes,
+    int3 srcVoxelPerDimension,
+    int *triIdx,
+    float3 *triHit)
+{
+    float3 bounds[2];
+    bounds[0] = srcVoxelBounds.lo.xyz;
+    bounds[1] = srcVoxelBounds.hi.xyz;
+    
+    Ray r = createRay(o, d);
+    ddaTriangleVolume(r, bounds, srcVoxelSizes, srcInvVoxelSizes, srcVoxelPerDimension, srcVertexPositions, srcVoxels, srcTrianglesInVoxels, triIdx, triHit);
+    
+    return *triIdx != -1;
+}
+
+/** Interpolate vertex colors of source triangle triIdx, alpha and beta being the weights of its first two vertices. */
+float4 sourceColor(__global float4* srcVertexColors, int triIdx, float alpha, float beta)
+{
+    float4 cA = srcVertexColors[triIdx*3+0];
+    float4 cB = srcVertexColors[triIdx*3+1];
+    float4 cC = srcVertexColors[triIdx*3+2];
+    return alpha * cA + beta * cB + (1.f - (alpha + beta)) * cC;
+}
+
+/** 
+    Trace from the point of target triangle triId given by barycentric weights w towards 
+    the source and interpolate the color of the source triangle hit. Returns false on miss.
+ */
+bool traceTarget(
+    int triId,
+    float3 w,
+    __global float3* targetVertexPositions,
+    __global float3* targetVertexNormals,
+    __global float3* srcVertexPositions,
+    __global float4* srcVertexColors,
+    __global int* srcVoxels,
+    __global int* srcTrianglesInVoxels,
+    float8 srcVoxelBounds,
+    float3 srcVoxelSizes,
+    float3 srcInvVoxelSizes,
+    int3 srcVoxelPerDimension,
+    float stepOut,
+    float4 *color)
+{
+    float3 o, d;
+    targetRay(triId, w, targetVertexPositions, targetVertexNormals, stepOut, &o, &d);
+    
+    int triIdx;
+    float3 triHit;
+    if (!traceSource(o, d, srcVertexPositions, srcVoxels, srcTrianglesInVoxels,
+                     srcVoxelBounds, srcVoxelSizes, srcInvVoxelSizes, srcVoxelPerDimension, &triIdx, &triHit)) {
+        return false;
+    }
+    
+    *color = sourceColor(srcVertexColors, triIdx, triHit.y, triHit.z);
+    return true;
+}
+
+/** Write color c to texel (x, y) and mark the texel in the optional coverage mask. */
+void writeTexel(__write_only image2d_t texture, __global uchar* coverage, int imageSize, int x, int y, float4 c)
+{
+    write_imagef(texture, (int2)(x, y), c);
+    if (coverage) {
+        coverage[y * imageSize + x] = 1;
+    }
+}
+
+/** 
+    Trace all samples of texel (x, y) covered by target triangle triId and sum the source 
+    colors hit. Returns the number of samples that hit the source.
+ */
+int bakeTexelSamples(
+    const Raster *r,
+    int x,
+    int y,
+    int triId,
+    __global float3* targetVertexPositions,
+    __global float3* targetVertexNormals,
+    __global float3* srcVertexPositions,
+    __global float4* srcVertexColors,
+    __global int* srcVoxels,
+    __global int* srcTrianglesInVoxels,
+    float8 srcVoxelBounds,
+    float3 srcVoxelSizes,
+    float3 srcInvVoxelSizes,
+    int3 srcVoxelPerDimension,
+    float stepOut,
+    float4 *sum)
+{
+    *sum = (float4)(0.f);
+    int hits = 0;
+    
+    for (int j = 0; j < r->samples; ++j) {
+        for (int i = 0; i < r->samples; ++i) {
+            long3 e = rasterSample(r, x * r->samples + i, y * r->samples + j);
+            float4 c;
+            if (rasterCovers(r, e) &&
+                traceTarget(triId, rasterWeights(r, e), targetVertexPositions, targetVertexNormals,
+                            srcVertexPositions, srcVertexColors, srcVoxels, srcTrianglesInVoxels,
+                            srcVoxelBounds, srcVoxelSizes, srcInvVoxelSizes, srcVoxelPerDimension, stepOut, &c))
+            {
+                *sum += c;
+                ++hits;
+            }
+        }
+    }
+    
+    return hits;
+}
+
+/** Fixed-point scale of accumulated colors. A texel takes 2^20 full intensity samples before overflowing. */
+#define ACCUM_SCALE 4096.f
+
+/** 
+    Add n samples summing to sum to the accumulated red, green, blue and sample count of 
+    texel. OpenCL 1.1 has no floating point atomics, so sums are kept in fixed-point.
+ */
+void accumulateTexel(__global uint* accumulation, int texel, float4 sum, int n)
+{
+    uint3 c = convert_uint3_sat_rte(clamp(sum.xyz, 0.f, (float)n) * ACCUM_SCALE);
+    
+    atomic_add(&accumulation[texel*4+0], c.x);
+    atomic_add(&accumulation[texel*4+1], c.y);
+    atomic_add(&accumulation[texel*4+2], c.z);
+    atomic_add(&accumulation[texel*4+3], (uint)n);
+}
+
+/**
+    Bake one target triangle per work-item. 
+    
+    The triangle is rasterized in UV space, visiting each texel of its bounding box once 
+    and tracing only covered samples. With a single sample per texel, edge functions are
+    stepped incrementally and texels are written directly, as the fill rule assigns each 
+    texel to exactly one triangle. With more samples a texel on a UV edge collects samples 
+    from several triangles, so sums are accumulated and written by resolveTexels.
+ */
 __kernel void bakeTextureMap(
     __global float3* targetVertexPositions,
     __global float3* targetVertexNormals,
@@ -28,11 +219,19 @@ __kernel void bakeTextureMap(
     float3 srcInvVoxelSizes,
     int3 srcVoxelPerDimension,
     __write_only image2d_t texture,
+    __global uchar* coverage,
+    __global uint* accumulation,
     int imageSize,
     float stepOut,
+    int samples,
     int nTargetTriangles
 )
 {
+    SPECIALIZE_IMAGE_SIZE(imageSize);
+    SPECIALIZE_SAMPLES(samples);
+    SPECIALIZE_STEP_OUT(stepOut);
+    SPECIALIZE_VOXELS(srcVoxelPerDimension);
+    
     int triId = get_global_id(0);
     if (triId >= nTargetTriangles) {
         return;
@@ -42,64 +241,759 @@ __kernel void bakeTextureMap(
     float2 uvB = targetVertexUVs[triId*3+1] * imageSize;
     float2 uvC = targetVertexUVs[triId*3+2] * imageSize;
     
-    float3 xA = targetVertexPositions[triId*3+0];
-    float3 xB = targetVertexPositions[triId*3+1];
-    float3 xC = targetVertexPositions[triId*3+2];
+    Raster r;
+    int2 pMin, pMax;
+    if (!setupRaster(uvA, uvB, uvC, samples, &r) || !rasterTexelRange(uvA, uvB, uvC, samples, imageSize, &pMin, &pMax)) {
+        return;
+    }
     
-    float3 nA = targetVertexNormals[triId*3+0];
-    float3 nB = targetVertexNormals[triId*3+1];
-    float3 nC = targetVertexNormals[triId*3+2];
+    if (samples > 1) {
+        for (int y = pMin.y; y <= pMax.y; ++y) {
+            for (int x = pMin.x; x <= pMax.x; ++x) {
+                float4 sum;
+                int n = bakeTexelSamples(&r, x, y, triId, targetVertexPositions, targetVertexNormals,
+                                         srcVertexPositions, srcVertexColors, srcVoxels, srcTrianglesInVoxels,
+                                         srcVoxelBounds, srcVoxelSizes, srcInvVoxelSizes, srcVoxelPerDimension, stepOut, &sum);
+                if (n > 0) {
+                    accumulateTexel(accumulation, y * imageSize + x, sum, n);
+                }
+            }
+        }
+        return;
+    }
     
-    float3 bounds[2];
-    bounds[0] = srcVoxelBounds.lo.xyz;
-    bounds[1] = srcVoxelBounds.hi.xyz;
+    long3 texelStepX = r.stepX * RASTER_SUBPIXELS;
+    long3 texelStepY = r.stepY * RASTER_SUBPIXELS;
+    long3 eRow = rasterSample(&r, pMin.x, pMin.y);
     
+    for (int y = pMin.y; y <= pMax.y; ++y) {
+        long3 e = eRow;
+        for (int x = pMin.x; x <= pMax.x; ++x) {
+            float4 c;
+            if (rasterCovers(&r, e) &&
+                traceTarget(triId, rasterWeights(&r, e), targetVertexPositions, targetVertexNormals,
+                            srcVertexPositions, srcVertexColors, srcVoxels, srcTrianglesInVoxels,
+                            srcVoxelBounds, srcVoxelSizes, srcInvVoxelSizes, srcVoxelPerDimension, stepOut, &c))
+            {
+                writeTexel(texture, coverage, imageSize, x, y, c);
+            }
+            e += texelStepX;
+        }
+        eRow += texelStepY;
+    }
+}
+
+/** Average accumulated samples of covered texels and write them to the texture. */
+__kernel void resolveTexels(
+    __global uint* accumulation,
+    __write_only image2d_t texture,
+    __global uchar* coverage,
+    int imageSize
+)
+{
+    int texel = get_global_id(0);
+    if (texel >= imageSize * imageSize) {
+        return;
+    }
     
-    // Rasterize triangle in UV space.
-    // We currently use a bary-centric approach guided by the UV bounding box of
-    // the triangl/Users/cheind/volplay/inc/volplay/rendering/image.he. This wastes
-    // performance as it samples the entire bounding box space, but has the advantage
-    // that barycentrics are required anyway.
-    
-    float2 uvMin = max(min(uvA, min(uvB, uvC)), 0.f);
-    float2 uvMax = min(max(uvA, max(uvB, uvC)), imageSize - 1.f);
-
-    float inv2A = 1.f / cross2(uvB - uvA, uvC - uvA);
-
-    for (float x = uvMin.x; x <= uvMax.x; x += 0.2f) {
-        for (float y = uvMin.y; y <= uvMax.y; y += 0.2f) {
-            
-            float2 q = (float2)(x,y);
-            float u = cross2(uvC - uvB, q - uvB) * inv2A;
-            float v = cross2(uvA - uvC, q - uvC) * inv2A;
-            float w = 1.f - u - v;
-            
-            if ((u >= 0) & (v >= 0) & (w >= 0)) {
-                // Inside triangle, create ray and march the source volume.
-                float3 rn = normalize(nA * u + nB * v + nC * w);
-                float3 ro = xA * u + xB * v + xC * w;
-                ro += rn * stepOut;
-                Ray r = createRay(ro, rn * -1.f);
-                
-                int triIdx = 0;
-                float3 triHit = (float3)(-1.f);
-                
-                ddaTriangleVolume(r, bounds, srcVoxelSizes, srcInvVoxelSizes, srcVoxelPerDimension, srcVertexPositions, srcVoxels, srcTrianglesInVoxels, &triIdx, &triHit);
-                
-                if (triIdx > -1) {
-                
-                    int2 pix = (int2)(round(x), round(y));
-                    
-                    float4 cA = srcVertexColors[triIdx*3+0];
-                    float4 cB = srcVertexColors[triIdx*3+1];
-                    float4 cC = srcVertexColors[triIdx*3+2];
-                    float4 c = triHit.y * cA + triHit.z * cB + (1.f - (triHit.y + triHit.z)) * cC;
-                
-                    write_imagef(texture, pix, c);
-                }
+    uint4 a = vload4(texel, accumulation);
+    if (a.w == 0) {
+        return;
+    }
+    
+    float3 c = convert_float3(a.xyz) / (ACCUM_SCALE * (float)a.w);
+    writeTexel(texture, coverage, imageSize, texel % imageSize, texel / imageSize, (float4)(c, 1.f));
+}
+
+/** Fill n integers of buffer with value. */
+__kernel void fillInt(
+    __global int* buffer,
+    int value,
+    int n
+)
+{
+    int i = get_global_id(0);
+    if (i < n) {
+        buffer[i] = value;
+    }
+}
+
+/**
+    First phase of per-texel baking. Rasterizes target triangles in UV space and
+    records for each texel having a covered sample the covering triangle. texelTriangles
+    needs to be -1 before.
+    
+    Work-items start at the global offset and end before nTargetTriangles. When UV
+    triangles overlap, the one with the largest id wins, as in bakeTiles, so the result
+    is independent of execution order.
+ */
+__kernel void rasterizeTexels(
+    __global float2* targetVertexUVs,
+    __global int* texelTriangles,
+    int imageSize,
+    int samples,
+    int nTargetTriangles
+)
+{
+    SPECIALIZE_IMAGE_SIZE(imageSize);
+    SPECIALIZE_SAMPLES(samples);
+    
+    int triId = get_global_id(0);
+    if (triId >= nTargetTriangles) {
+        return;
+    }
+    
+    float2 uvA = targetVertexUVs[triId*3+0] * imageSize;
+    float2 uvB = targetVertexUVs[triId*3+1] * imageSize;
+    float2 uvC = targetVertexUVs[triId*3+2] * imageSize;
+    
+    Raster r;
+    int2 pMin, pMax;
+    if (!setupRaster(uvA, uvB, uvC, samples, &r) || !rasterTexelRange(uvA, uvB, uvC, samples, imageSize, &pMin, &pMax)) {
+        return;
+    }
+    
+    for (int y = pMin.y; y <= pMax.y; ++y) {
+        for (int x = pMin.x; x <= pMax.x; ++x) {
+            if (rasterCoversTexel(&r, x, y)) {
+                atomic_max(&texelTriangles[y * imageSize + x], triId);
+            }
+        }
+    }
+}
+
+/**
+    Append mapped texels to a compact list of texel indices and store the barycentrics of 
+    the first covered sample of each listed texel. texelCount needs to be zero before.
+    
+    Work-items start at the global offset and end before texelEnd.
+ */
+__kernel void compactTexels(
+    __global float2* targetVertexUVs,
+    __global int* texelTriangles,
+    __global float2* texelBarycentrics,
+    __global int* texels,
+    __global int* texelCount,
+    int imageSize,
+    int samples,
+    int texelEnd
+)
+{
+    int texel = get_global_id(0);
+    if (texel >= texelEnd) {
+        return;
+    }
+    
+    int triId = texelTriangles[texel];
+    if (triId < 0) {
+        return;
+    }
+    
+    Raster r;
+    setupRaster(targetVertexUVs[triId*3+0] * imageSize, targetVertexUVs[triId*3+1] * imageSize, targetVertexUVs[triId*3+2] * imageSize, samples, &r);
+    
+    int x = texel % imageSize;
+    int y = texel / imageSize;
+    bool found = false;
+    for (int j = 0; (j < samples) & !found; ++j) {
+        for (int i = 0; (i < samples) & !found; ++i) {
+            long3 e = rasterSample(&r, x * samples + i, y * samples + j);
+            if (rasterCovers(&r, e)) {
+                texelBarycentrics[texel] = rasterWeights(&r, e).xy;
+                found = true;
             }
-            
         }
     }
+    
+    texels[atomic_inc(texelCount)] = texel;
+}
+
+/** Spread the lower 6 bits of v, so that two zero bits follow each. */
+uint spreadBits(uint v)
+{
+    uint r = 0;
+    for (int b = 0; b < 6; ++b) {
+        r |= ((v >> b) & 1u) << (3 * b);
+    }
+    return r;
+}
+
+/**
+    Compute sort keys of listed texel rays. Keys consist of the Morton code of the ray 
+    origin within the source bounds, 6 bits per axis, followed by 6 bits of octahedral 
+    encoded direction. Rays with close keys traverse nearby voxels in similar order.
+ */
+__kernel void computeRayKeys(
+    __global int* texels,
+    __global int* texelCount,
+    __global int* texelTriangles,
+    __global float2* texelBarycentrics,
+    __global float3* targetVertexPositions,
+    __global float3* targetVertexNormals,
+    float8 srcVoxelBounds,
+    float stepOut,
+    __global uint* keys
+)
+{
+    int i = get_global_id(0);
+    if (i >= *texelCount) {
+        return;
+    }
+    
+    int texel = texels[i];
+    int triId = texelTriangles[texel];
+    float2 bary = texelBarycentrics[texel];
+    
+    float3 ro, d;
+    targetRay(triId, (float3)(bary.x, bary.y, 1.f - bary.x - bary.y), targetVertexPositions, targetVertexNormals, stepOut, &ro, &d);
+    
+    float3 lo = srcVoxelBounds.lo.xyz;
+    float3 hi = srcVoxelBounds.hi.xyz;
+    uint3 cell = convert_uint3(clamp((ro - lo) / (hi - lo), 0.f, 1.f) * 63.f);
+    uint morton = spreadBits(cell.x) | (spreadBits(cell.y) << 1) | (spreadBits(cell.z) << 2);
+    
+    // Octahedral encoding of the ray direction.
+    float2 o = d.xy / (fabs(d.x) + fabs(d.y) + fabs(d.z));
+    if (d.z < 0.f) {
+        o = (1.f - fabs(o.yx)) * (float2)(o.x >= 0.f ? 1.f : -1.f, o.y >= 0.f ? 1.f : -1.f);
+    }
+    uint2 od = convert_uint2(clamp(o * 0.5f + 0.5f, 0.f, 1.f) * 7.f);
+    
+    keys[i] = (morton << 6) | (od.y << 3) | od.x;
+}
+
+/** 
+    Bake a single texel of the texel map. With more than one sample per texel the 
+    samples are rasterized again from the target triangle.
+ */
+void bakeMappedTexel(
+    int texel,
+    __global int* texelTriangles,
+    __global float2* texelBarycentrics,
+    __global float3* targetVertexPositions,
+    __global float3* targetVertexNormals,
+    __global float2* targetVertexUVs,
+    __global float3* srcVertexPositions,
+    __global float4* srcVertexColors,
+    __global int* srcVoxels,
+    __global int* srcTrianglesInVoxels,
+    float8 srcVoxelBounds,
+    float3 srcVoxelSizes,
+    float3 srcInvVoxelSizes,
+    int3 srcVoxelPerDimension,
+    __write_only image2d_t texture,
+    __global uchar* coverage,
+    int imageSize,
+    float stepOut,
+    int samples)
+{
+    int triId = texelTriangles[texel];
+    int x = texel % imageSize;
+    int y = texel / imageSize;
+    
+    float4 c;
+    int hits;
+    
+    if (samples == 1) {
+        float2 bary = texelBarycentrics[texel];
+        hits = traceTarget(triId, (float3)(bary.x, bary.y, 1.f - bary.x - bary.y), targetVertexPositions, targetVertexNormals,
+                           srcVertexPositions, srcVertexColors, srcVoxels, srcTrianglesInVoxels,
+                           srcVoxelBounds, srcVoxelSizes, srcInvVoxelSizes, srcVoxelPerDimension, stepOut, &c) ? 1 : 0;
+    } else {
+        Raster r;
+        setupRaster(targetVertexUVs[triId*3+0] * imageSize, targetVertexUVs[triId*3+1] * imageSize, targetVertexUVs[triId*3+2] * imageSize, samples, &r);
+        hits = bakeTexelSamples(&r, x, y, triId, targetVertexPositions, targetVertexNormals,
+                                srcVertexPositions, srcVertexColors, srcVoxels, srcTrianglesInVoxels,
+                                srcVoxelBounds, srcVoxelSizes, srcInvVoxelSizes, srcVoxelPerDimension, stepOut, &c);
+    }
+    
+    if (hits > 0) {
+        writeTexel(texture, coverage, imageSize, x, y, c / (float)hits);
+    }
 }
 
+/**
+    Second phase of per-texel baking. One work-item per listed texel traces from
+    the target surface point towards the source, so work is balanced independent
+    of UV triangle sizes.
+ */
+__kernel void bakeTexels(
+    __global int* texels,
+    __global int* texelCount,
+    __global int* texelTriangles,
+    __global float2* texelBarycentrics,
+    __global float3* targetVertexPositions,
+    __global float3* targetVertexNormals,
+    __global float2* targetVertexUVs,
+    __global float3* srcVertexPositions,
+    __global float3* srcVertexNormals,
+    __global float4* srcVertexColors,
+    __global int* srcVoxels,
+    __global int* srcTrianglesInVoxels,
+    float8 srcVoxelBounds,
+    float3 srcVoxelSizes,
+    float3 srcInvVoxelSizes,
+    int3 srcVoxelPerDimension,
+    __write_only image2d_t texture,
+    __global uchar* coverage,
+    int imageSize,
+    float stepOut,
+    int samples
+)
+{
+    SPECIALIZE_IMAGE_SIZE(imageSize);
+    SPECIALIZE_SAMPLES(samples);
+    SPECIALIZE_STEP_OUT(stepOut);
+    SPECIALIZE_VOXELS(srcVoxelPerDimension);
+    
+    int i = get_global_id(0);
+    if (i >= *texelCount) {
+        return;
+    }
+    
+    bakeMappedTexel(texels[i], texelTriangles, texelBarycentrics, targetVertexPositions, targetVertexNormals, targetVertexUVs,
+                    srcVertexPositions, srcVertexColors, srcVoxels, srcTrianglesInVoxels,
+                    srcVoxelBounds, srcVoxelSizes, srcInvVoxelSizes, srcVoxelPerDimension, texture, coverage, imageSize, stepOut, samples);
+}
+
+/** Listed texels a work-item of the persistent kernel bakes per pull from the work queue. */
+#define PERSISTENT_BATCH 4
+
+/**
+    Persistent-threads variant of bakeTexels. 
+    
+    Only enough work-items to fill the device are launched. Work-groups repeatedly pull 
+    batches of listed texels from the nextTexel counter until the list is exhausted, so 
+    groups finishing cheap rays early take over work instead of idling while a few 
+    expensive rays complete. nextTexel needs to be zero before.
+ */
+__kernel void bakeTexelsPersistent(
+    __global int* texels,
+    __global int* texelCount,
+    __global int* nextTexel,
+    __global int* texelTriangles,
+    __global float2* texelBarycentrics,
+    __global float3* targetVertexPositions,
+    __global float3* targetVertexNormals,
+    __global float2* targetVertexUVs,
+    __global float3* srcVertexPositions,
+    __global float3* srcVertexNormals,
+    __global float4* srcVertexColors,
+    __global int* srcVoxels,
+    __global int* srcTrianglesInVoxels,
+    float8 srcVoxelBounds,
+    float3 srcVoxelSizes,
+    float3 srcInvVoxelSizes,
+    int3 srcVoxelPerDimension,
+    __write_only image2d_t texture,
+    __global uchar* coverage,
+    int imageSize,
+    float stepOut,
+    int samples
+)
+{
+    SPECIALIZE_IMAGE_SIZE(imageSize);
+    SPECIALIZE_SAMPLES(samples);
+    SPECIALIZE_STEP_OUT(stepOut);
+    SPECIALIZE_VOXELS(srcVoxelPerDimension);
+    
+    __local int base;
+    
+    int lid = get_local_id(0);
+    int size = get_local_size(0);
+    int count = *texelCount;
+    
+    while (true) {
+        // Batches are pulled per work-group, so neighboring work-items bake neighboring
+        // list entries and the loop condition is uniform across the group.
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid == 0) {
+            base = atomic_add(nextTexel, size * PERSISTENT_BATCH);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        int first = base;
+        if (first >= count) {
+            break;
+        }
+        
+        for (int k = 0; k < PERSISTENT_BATCH; ++k) {
+            int i = first + k * size + lid;
+            if (i < count) {
+                bakeMappedTexel(texels[i], texelTriangles, texelBarycentrics, targetVertexPositions, targetVertexNormals, targetVertexUVs,
+                                srcVertexPositions, srcVertexColors, srcVoxels, srcTrianglesInVoxels,
+                                srcVoxelBounds, srcVoxelSizes, srcInvVoxelSizes, srcVoxelPerDimension, texture, coverage, imageSize, stepOut, samples);
+            }
+        }
+    }
+}
+
+/**
+    Ray generation stage of the wavefront pipeline. Creates one ray per sample of listed 
+    texels in [firstTexel, firstTexel + nRays / samples^2). Rays of uncovered samples and 
+    of entries beyond the list get a zero direction.
+ */
+__kernel void generateRays(
+    __global int* texels,
+    __global int* texelCount,
+    __global int* texelTriangles,
+    __global float2* texelBarycentrics,
+    __global float3* targetVertexPositions,
+    __global float3* targetVertexNormals,
+    __global float2* targetVertexUVs,
+    int imageSize,
+    float stepOut,
+    int samples,
+    int firstTexel,
+    int nRays,
+    __global float4* rayOrigins,
+    __global float4* rayDirections
+)
+{
+    SPECIALIZE_IMAGE_SIZE(imageSize);
+    SPECIALIZE_SAMPLES(samples);
+    SPECIALIZE_STEP_OUT(stepOut);
+    
+    int ray = get_global_id(0);
+    if (ray >= nRays) {
+        return;
+    }
+    
+    int samplesPerTexel = samples * samples;
+    int i = firstTexel + ray / samplesPerTexel;
+    int sample = ray % samplesPerTexel;
+    
+    rayDirections[ray] = (float4)(0.f);
+    if (i >= *texelCount) {
+        return;
+    }
+    
+    int texel = texels[i];
+    int triId = texelTriangles[texel];
+    float3 w;
+    
+    if (samples == 1) {
+        float2 bary = texelBarycentrics[texel];
+        w = (float3)(bary.x, bary.y, 1.f - bary.x - bary.y);
+    } else {
+        Raster r;
+        setupRaster(targetVertexUVs[triId*3+0] * imageSize, targetVertexUVs[triId*3+1] * imageSize, targetVertexUVs[triId*3+2] * imageSize, samples, &r);
+        
+        int sx = (texel % imageSize) * samples + sample % samples;
+        int sy = (texel / imageSize) * samples + sample / samples;
+        long3 e = rasterSample(&r, sx, sy);
+        if (!rasterCovers(&r, e)) {
+            return;
+        }
+        w = rasterWeights(&r, e);
+    }
+    
+    float3 o, d;
+    targetRay(triId, w, targetVertexPositions, targetVertexNormals, stepOut, &o, &d);
+    rayOrigins[ray] = (float4)(o, 1.f);
+    rayDirections[ray] = (float4)(d, 0.f);
+}
+
+/**
+    Trace stage of the wavefront pipeline. Marches the source volume for each ray and 
+    stores a compact hit record of source triangle, barycentrics and ray parameter as 
+    (triangle, alpha, beta, t). The triangle is -1 for misses and empty rays.
+ */
+__kernel void traceRays(
+    __global float4* rayOrigins,
+    __global float4* rayDirections,
+    int nRays,
+    __global float3* srcVertexPositions,
+    __global float3* srcVertexNormals,
+    __global float4* srcVertexColors,
+    __global int* srcVoxels,
+    __global int* srcTrianglesInVoxels,
+    float8 srcVoxelBounds,
+    float3 srcVoxelSizes,
+    float3 srcInvVoxelSizes,
+    int3 srcVoxelPerDimension,
+    __global int4* hits
+)
+{
+    SPECIALIZE_VOXELS(srcVoxelPerDimension);
+    
+    int ray = get_global_id(0);
+    if (ray >= nRays) {
+        return;
+    }
+    
+    float3 d = rayDirections[ray].xyz;
+    
+    int triIdx = -1;
+    float3 triHit = (float3)(-1.f);
+    if (any(d != 0.f)) {
+        traceSource(rayOrigins[ray].xyz, d, srcVertexPositions, srcVoxels, srcTrianglesInVoxels,
+                    srcVoxelBounds, srcVoxelSizes, srcInvVoxelSizes, srcVoxelPerDimension, &triIdx, &triHit);
+    }
+    
+    hits[ray] = (int4)(triIdx, as_int(triHit.y), as_int(triHit.z), as_int(triHit.x));
+}
+
+/**
+    Shade stage of the wavefront pipeline. One work-item per listed texel of the wave 
+    averages the source colors of its sample hits and writes the texel.
+ */
+__kernel void shadeTexels(
+    __global int* texels,
+    __global int* texelCount,
+    __global int4* hits,
+    __global float4* srcVertexColors,
+    __write_only image2d_t texture,
+    __global uchar* coverage,
+    int imageSize,
+    int samples,
+    int firstTexel,
+    int nWaveTexels
+)
+{
+    SPECIALIZE_IMAGE_SIZE(imageSize);
+    SPECIALIZE_SAMPLES(samples);
+    
+    int waveTexel = get_global_id(0);
+    int i = firstTexel + waveTexel;
+    if ((waveTexel >= nWaveTexels) || (i >= *texelCount)) {
+        return;
+    }
+    
+    int samplesPerTexel = samples * samples;
+    float4 sum = (float4)(0.f);
+    int n = 0;
+    
+    for (int k = 0; k < samplesPerTexel; ++k) {
+        int4 h = hits[waveTexel * samplesPerTexel + k];
+        if (h.x != -1) {
+            sum += sourceColor(srcVertexColors, h.x, as_float(h.y), as_float(h.z));
+            ++n;
+        }
+    }
+    
+    if (n > 0) {
+        int texel = texels[i];
+        writeTexel(texture, coverage, imageSize, texel % imageSize, texel / imageSize, sum / (float)n);
+    }
+}
+
+/** Edge length of square texture tiles in texels. One work-group bakes one tile. */
+#define TILE_SIZE 16
+
+/** Number of tile triangles staged in local memory at once. */
+#define TILE_BATCH 64
+
+/** Compute the range of tiles overlapped by texels having samples within the UV bounding box of a triangle. */
+bool triangleTileRange(float2 uvA, float2 uvB, float2 uvC, int samples, int imageSize, int2 *tMin, int2 *tMax)
+{
+    int2 pMin, pMax;
+    if (!rasterTexelRange(uvA, uvB, uvC, samples, imageSize, &pMin, &pMax)) {
+        return false;
+    }
+    
+    *tMin = pMin / TILE_SIZE;
+    *tMax = pMax / TILE_SIZE;
+    return true;
+}
+
+/** First binning pass. Counts target triangles per tile. */
+__kernel void countTileTriangles(
+    __global float2* targetVertexUVs,
+    __global int* tileCounts,
+    int imageSize,
+    int samples,
+    int nTargetTriangles
+)
+{
+    int triId = get_global_id(0);
+    if (triId >= nTargetTriangles) {
+        return;
+    }
+    
+    int2 tMin, tMax;
+    if (!triangleTileRange(targetVertexUVs[triId*3+0] * imageSize, targetVertexUVs[triId*3+1] * imageSize, targetVertexUVs[triId*3+2] * imageSize, samples, imageSize, &tMin, &tMax)) {
+        return;
+    }
+    
+    int tilesPerRow = (imageSize + TILE_SIZE - 1) / TILE_SIZE;
+    for (int ty = tMin.y; ty <= tMax.y; ++ty) {
+        for (int tx = tMin.x; tx <= tMax.x; ++tx) {
+            atomic_inc(&tileCounts[ty * tilesPerRow + tx]);
+        }
+    }
+}
+
+/** 
+    Second binning pass. Appends target triangles to the lists of tiles they overlap.
+    tileEnds holds list offsets before and list ends afterwards.
+ */
+__kernel void binTileTriangles(
+    __global float2* targetVertexUVs,
+    __global int* tileEnds,
+    __global int* tileTriangles,
+    int capacity,
+    int imageSize,
+    int samples,
+    int nTargetTriangles
+)
+{
+    int triId = get_global_id(0);
+    if (triId >= nTargetTriangles) {
+        return;
+    }
+    
+    int2 tMin, tMax;
+    if (!triangleTileRange(targetVertexUVs[triId*3+0] * imageSize, targetVertexUVs[triId*3+1] * imageSize, targetVertexUVs[triId*3+2] * imageSize, samples, imageSize, &tMin, &tMax)) {
+        return;
+    }
+    
+    int tilesPerRow = (imageSize + TILE_SIZE - 1) / TILE_SIZE;
+    for (int ty = tMin.y; ty <= tMax.y; ++ty) {
+        for (int tx = tMin.x; tx <= tMax.x; ++tx) {
+            int slot = atomic_inc(&tileEnds[ty * tilesPerRow + tx]);
+            if (slot < capacity) {
+                tileTriangles[slot] = triId;
+            }
+        }
+    }
+}
+
+/**
+    Bake one tile per work-group of TILE_SIZE x TILE_SIZE work-items. 
+    
+    The triangle list of the tile is staged in local memory in batches, against which 
+    every work-item tests the samples of its texel. Of several covering triangles the 
+    one with the largest id wins, which makes the result independent of binning order.
+    Lists are cut at the capacity of tileTriangles, beyond which binning dropped entries.
+    Launches span full tile rows and may start at a row offset.
+ */
+__kernel void bakeTiles(
+    __global int* tileOffsets,
+    __global int* tileEnds,
+    __global int* tileTriangles,
+    int capacity,
+    __global float2* targetVertexUVs,
+    __global float3* targetVertexPositions,
+    __global float3* targetVertexNormals,
+    __global float3* srcVertexPositions,
+    __global float3* srcVertexNormals,
+    __global float4* srcVertexColors,
+    __global int* srcVoxels,
+    __global int* srcTrianglesInVoxels,
+    float8 srcVoxelBounds,
+    float3 srcVoxelSizes,
+    float3 srcInvVoxelSizes,
+    int3 srcVoxelPerDimension,
+    __write_only image2d_t texture,
+    __global uchar* coverage,
+    int imageSize,
+    float stepOut,
+    int samples
+)
+{
+    SPECIALIZE_IMAGE_SIZE(imageSize);
+    SPECIALIZE_SAMPLES(samples);
+    SPECIALIZE_STEP_OUT(stepOut);
+    SPECIALIZE_VOXELS(srcVoxelPerDimension);
+    
+    __local int tris[TILE_BATCH];
+    __local float2 uvs[TILE_BATCH * 3];
+    
+    // Tile rows are derived from global ids, which include the global offset of a partial launch.
+    int tile = (get_global_id(1) / TILE_SIZE) * get_num_groups(0) + get_group_id(0);
+    int lid = get_local_id(1) * TILE_SIZE + get_local_id(0);
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    
+    int begin = tileOffsets[tile];
+    int count = min(tileEnds[tile], capacity) - begin;
+    
+    int bestTri = -1;
+    
+    // All work-items take part in staging, including those outside of the image.
+    for (int base = 0; base < count; base += TILE_BATCH) {
+        int n = min(TILE_BATCH, count - base);
+        
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for (int i = lid; i < n; i += TILE_SIZE * TILE_SIZE) {
+            int triId = tileTriangles[begin + base + i];
+            tris[i] = triId;
+            uvs[i*3+0] = targetVertexUVs[triId*3+0] * imageSize;
+            uvs[i*3+1] = targetVertexUVs[triId*3+1] * imageSize;
+            uvs[i*3+2] = targetVertexUVs[triId*3+2] * imageSize;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        for (int i = 0; i < n; ++i) {
+            Raster r;
+            if ((tris[i] > bestTri) && setupRaster(uvs[i*3+0], uvs[i*3+1], uvs[i*3+2], samples, &r) &&
+                rasterCoversTexel(&r, x, y))
+            {
+                bestTri = tris[i];
+            }
+        }
+    }
+    
+    if ((bestTri == -1) | (x >= imageSize) | (y >= imageSize)) {
+        return;
+    }
+    
+    Raster r;
+    setupRaster(targetVertexUVs[bestTri*3+0] * imageSize, targetVertexUVs[bestTri*3+1] * imageSize, targetVertexUVs[bestTri*3+2] * imageSize, samples, &r);
+    
+    float4 sum;
+    int n = bakeTexelSamples(&r, x, y, bestTri, targetVertexPositions, targetVertexNormals,
+                             srcVertexPositions, srcVertexColors, srcVoxels, srcTrianglesInVoxels,
+                             srcVoxelBounds, srcVoxelSizes, srcInvVoxelSizes, srcVoxelPerDimension, stepOut, &sum);
+    if (n > 0) {
+        writeTexel(texture, coverage, imageSize, x, y, sum / (float)n);
+    }
+}
+
+/** Sampler reading single texels of the texture. */
+__constant sampler_t texelSampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+/**
+    One step of edge padding around UV islands. Uncovered texels next to covered ones take
+    the average of their covered 8-neighbors and become covered, covered texels are copied.
+    Runs on two textures and coverage masks in ping-pong fashion, one step per texel of padding.
+ */
+__kernel void dilateTexels(
+    __read_only image2d_t src,
+    __global uchar* srcCoverage,
+    __write_only image2d_t dst,
+    __global uchar* dstCoverage,
+    int imageSize
+)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if ((x >= imageSize) | (y >= imageSize)) {
+        return;
+    }
+    
+    int texel = y * imageSize + x;
+    if (srcCoverage[texel]) {
+        write_imagef(dst, (int2)(x, y), read_imagef(src, texelSampler, (int2)(x, y)));
+        dstCoverage[texel] = 1;
+        return;
+    }
+    
+    float4 sum = (float4)(0.f);
+    int n = 0;
+    
+    for (int dy = -1; dy <= 1; ++dy) {
+        for (int dx = -1; dx <= 1; ++dx) {
+            int2 p = (int2)(x + dx, y + dy);
+            if (all(p >= 0) && all(p < imageSize) && srcCoverage[p.y * imageSize + p.x]) {
+                sum += read_imagef(src, texelSampler, p);
+                ++n;
+            }
+        }
+    }
+    
+    // Destination textures carry content of previous passes, so uncovered texels are cleared.
+    write_imagef(dst, (int2)(x, y), (n > 0) ? sum / (float)n : (float4)(0.f));
+    dstCoverage[texel] = (n > 0) ? 1 : 0;
+}
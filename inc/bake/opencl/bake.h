@@ -6,12 +6,417 @@
 // If a copy of the BSD was not distributed with this file, You can obtain
 // one at http://opensource.org/licenses/BSD-3-Clause.
 
+#ifndef BAKE_OPENCL_BAKE
+#define BAKE_OPENCL_BAKE
+
 #include <bake/geometry.h>
+#include <bake/image.h>
+#include <memory>
+#include <functional>
+#include <string>
+#include <vector>
 
 namespace bake {
     namespace opencl {
         
+        /** Coarse classification of OpenCL devices. */
+        enum DeviceType {
+            DeviceTypeCPU,
+            DeviceTypeGPU,
+            DeviceTypeAccelerator,
+            DeviceTypeOther
+        };
+        
+        /** Capabilities of an OpenCL device. */
+        struct DeviceInfo {
+            /** Device id as accepted by Baker::init. */
+            int id;
+            std::string name;
+            std::string vendor;
+            std::string platformName;
+            std::string driverVersion;
+            DeviceType type;
+            int computeUnits;
+            /** Maximum clock frequency in MHz. */
+            int maxClockFrequency;
+            unsigned long long globalMemorySize;
+            unsigned long long maxAllocationSize;
+            bool imageSupport;
+            /** True for devices sharing physical memory with the host, such as CPUs and integrated GPUs. */
+            bool hostUnifiedMemory;
+        };
+        
+        /** Policies to pick a device automatically. */
+        enum DevicePolicy {
+            /** Device with most compute units. */
+            SelectMostComputeUnits,
+            /** Device with largest global memory. */
+            SelectLargestMemory,
+            /** Device with highest compute units times clock frequency. */
+            SelectHighestThroughput
+        };
+        
+        /** How surface data is made available to the device. */
+        enum HostMemoryMode {
+            /** Zero-copy on devices reporting host unified memory, copy otherwise. */
+            HostMemoryAuto,
+            /** Always copy surface data to device memory. */
+            HostMemoryCopy,
+            /** 
+                Let the device read surface data in place using CL_MEM_USE_HOST_PTR. Source 
+                grids are page aligned for this, surface matrices that are not are staged 
+                once into page aligned host memory.
+             */
+            HostMemoryZeroCopy
+        };
+        
+        /** Acceleration structure built over the source. */
+        enum GridType {
+            /** Single uniform grid. */
+            GridUniform,
+            /** Coarse grid whose dense voxels are subdivided into sub-grids. Suits meshes of non-uniform triangle density. */
+            GridTwoLevel
+        };
+        
+        /** List all devices of all OpenCL platforms. */
+        std::vector<DeviceInfo> listDevices();
+        
+        /** 
+            Pick a device according to policy. 
+         
+            Devices without image support are never selected. Returns the device id 
+            or -1 when no suitable device exists.
+         */
+        int selectDevice(const std::vector<DeviceInfo> &devices, DevicePolicy policy);
+        
+        /** How bake work is distributed over work-items. */
+        enum BakeDispatch {
+            /** One work-item per target triangle rasterizing its UV footprint. */
+            DispatchPerTriangle,
+            /** 
+                Rasterize a map of covered texels first, then trace with one work-item per 
+                covered texel. Balances work independent of UV triangle sizes.
+             */
+            DispatchPerTexel,
+            /**
+                Bin target triangles into 16x16 texel tiles first, then bake one tile per 
+                work-group with the tile's triangles staged in local memory. Falls back to 
+                per-texel dispatch on devices not supporting work-groups of 256 items.
+             */
+            DispatchTiled,
+            /**
+                Rasterize a map of covered texels like per-texel dispatch, then launch only as 
+                many work-items as the device runs at once. These pull batches of texels from 
+                a global work queue until all are baked, which avoids idling on long-running 
+                rays.
+             */
+            DispatchPersistent,
+            /**
+                Rasterize a map of covered texels like per-texel dispatch, then bake it in 
+                waves of separate kernels for ray generation, tracing and shading connected 
+                by device buffers. The lean trace kernel runs at higher occupancy and each 
+                stage can be profiled on its own.
+             */
+            DispatchWavefront
+        };
+        
+        /** Per target bake parameters. */
+        struct BakeParameters {
+            /** Distance along target normals from where rays towards the source start. */
+            float stepOut;
+            /** Work distribution of the bake kernels. */
+            BakeDispatch dispatch;
+            /** 
+                Samples per texel along each axis. Texels are divided into a regular grid of
+                strata, each traced at a jittered position, and the source colors hit are 
+                averaged. The default of one traces texel centers only. Needs to be a power 
+                of two not larger than 16. With per-triangle dispatch, samples of texels on
+                UV edges are accumulated over all triangles covering them.
+             */
+            int samplesPerAxis;
+            /** 
+                Sort texel rays by origin and direction before tracing, so that neighboring
+                work-items traverse nearby voxels. Only used by dispatch modes baking a 
+                texel list, that is per-texel, persistent and wavefront dispatch.
+             */
+            bool sortRays;
+            /** 
+                Texels of edge padding around UV islands. Uncovered texels are filled from 
+                their covered neighbors on the device before readback, which keeps texture 
+                filtering and mip-mapping from bleeding black into islands. Zero disables 
+                padding.
+             */
+            int dilation;
+            
+            BakeParameters()
+            : stepOut(0.5f), dispatch(DispatchPerTriangle), samplesPerAxis(1), sortRays(false), dilation(0)
+            {}
+        };
+        
+        /** A single target of a batch bake. */
+        struct BakeTarget {
+            /** Target surface providing positions, normals and UVs. */
+            const Surface *surface;
+            /** Allocated output texture. */
+            Image<unsigned char> *texture;
+            BakeParameters params;
+            
+            BakeTarget()
+            : surface(0), texture(0)
+            {}
+            
+            BakeTarget(const Surface *s, Image<unsigned char> *t, const BakeParameters &p = BakeParameters())
+            : surface(s), texture(t), params(p)
+            {}
+        };
+        
+        /** 
+            Timing of a batch bake measured by device profiling.
+         
+            Busy times are summed over all commands of a kind. When transfers and kernels
+            overlap, the wall time is less than the sum of all busy times.
+        */
+        struct PipelineStats {
+            /** Busy time of target writes. Clearing device memory counts as kernel time. */
+            double uploadMs;
+            double kernelMs;
+            double readbackMs;
+            /** Time from start of the first to end of the last command. */
+            double wallMs;
+            /** Fraction of busy time hidden by overlap. Zero for serial execution. */
+            double overlap;
+        };
+        
+        /** Bake completion callback. Receives true when the bake succeeded. */
+        typedef std::function<void(bool)> BakeCallback;
+        
+        /** 
+            Handle to a bake running asynchronously on the device. 
+         
+            Copies refer to the same bake. Device resources are kept alive until the 
+            bake completed.
+        */
+        class BakeTask {
+        public:
+            /** Create an invalid task. */
+            BakeTask();
+            
+            /** Test if task refers to a successfully enqueued bake. */
+            bool valid() const;
+            
+            /** Test without blocking if the bake has finished. */
+            bool ready() const;
+            
+            /** Block until the bake has finished. Returns true when it succeeded. */
+            bool wait();
+            
+            /** Opaque task state. */
+            struct State;
+            
+        private:
+            friend class Baker;
+            std::shared_ptr<State> _state;
+        };
+        
+        /** 
+            Long-lived baking context. 
+         
+            Owns the OpenCL context, command queue, compiled program and kernels. Create
+            and initialize once, then run any number of bakes without paying for device 
+            setup and program compilation again. A baker must not be used from multiple
+            threads concurrently.
+        */
+        class Baker {
+        public:
+            /** Create an uninitialized baker. */
+            Baker();
+            
+            /** Release all OpenCL resources. */
+            ~Baker();
+            
+            /** 
+                Set directory used to cache compiled program binaries. 
+             
+                Must be called before init to take effect. The directory needs to exist. 
+                An empty path, the default, disables caching.
+             */
+            void setProgramCacheDirectory(const std::string &dir);
+            
+            /** 
+                Set how surface data is made available to the device. 
+             
+                Must be called before init to take effect. With zero-copy active, the source 
+                passed to setSource must stay alive as long as it is in use.
+             */
+            void setHostMemoryMode(HostMemoryMode mode);
+            
+            /** 
+                Enable kernels specialized to the launch constants of a bake. 
+             
+                Texture size, samples per texel, step out distance and source grid resolution 
+                are then compiled into the kernels instead of being passed as arguments. Each 
+                combination is built once on first use and kept for the lifetime of the baker, 
+                which pays off when batches share these constants. Disabled by default.
+             */
+            void setKernelSpecialization(bool enable);
+            
+            /** 
+                Set the resolution of the source grid built by setSource.
+             
+                Zero in any dimension, the default, chooses the resolution from the triangle 
+                count, the grid density and the aspect ratio of the source bounds.
+             */
+            void setGridResolution(const Eigen::Vector3i &voxelsPerDimension);
+            
+            /** Set the average number of triangles per voxel targeted by automatic grid resolution. Defaults to 2. */
+            void setGridDensity(float trianglesPerVoxel);
+            
+            /** 
+                Set the acceleration structure built by setSource. Defaults to GridUniform. 
+             
+                For two-level grids the grid resolution refers to the top level, which when 
+                chosen automatically is coarser than a uniform grid would be.
+             */
+            void setGridType(GridType type);
+            
+            /** Select device, create context and queue and build kernels. */
+            bool init(int deviceId);
+            
+            /** Initialize on the device chosen by policy. */
+            bool init(DevicePolicy policy);
+            
+            /** Test if init succeeded. */
+            bool isInitialized() const;
+            
+            /** 
+                Benchmark local work sizes of the main bake kernels on a synthetic workload 
+                and use the fastest ones from now on. 
+             
+                Requires init. The current source is left untouched. When a program cache 
+                directory is set, the results are stored there as a per-device profile, which 
+                init loads on later runs, so tuning needs to run only once per device, driver 
+                and library version.
+             */
+            bool tuneWorkGroupSizes();
+            
+            /** 
+                Upload source surface and its acceleration structure. 
+             
+                The source stays resident on the device and is used by all subsequent 
+                bakes until replaced.
+             */
+            bool setSource(const Surface &src);
+            
+            /**
+                Enqueue a bake of the current source onto target and return without waiting 
+                for the device.
+             
+                The texture needs to be allocated by the caller, its number of rows determines 
+                the texture resolution. Target is read and texture is written asynchronously, 
+                both must stay alive until the task finished. 
+                The optional callback is invoked from an OpenCL runtime thread. On failure
+                an invalid task is returned and the callback is never invoked.
+             */
+            BakeTask bakeTextureMapAsync(const Surface &target, Image<unsigned char> &texture,
+                                         const BakeParameters &params = BakeParameters(),
+                                         const BakeCallback &callback = BakeCallback());
+            
+            /** Set source and enqueue a bake with default parameters. */
+            BakeTask bakeTextureMapAsync(const Surface &src, const Surface &target, Image<unsigned char> &texture,
+                                         const BakeCallback &callback = BakeCallback());
+            
+            /** Set source, bake vertex colors of source onto the texture map of target and wait. */
+            bool bakeTextureMap(const Surface &src, const Surface &target, Image<unsigned char> &texture);
+            
+            /** 
+                Bake source onto many targets. 
+             
+                Source is uploaded once and targets are streamed through the device. Uploads 
+                and readbacks run on a transfer queue and overlap kernels of neighboring 
+                targets. Returns true when all targets succeeded. When given, stats receives
+                the achieved overlap.
+             */
+            bool bakeTextureMaps(const Surface &src, const std::vector<BakeTarget> &targets, PipelineStats *stats = 0);
+            
+        private:
+            Baker(const Baker &);
+            Baker &operator=(const Baker &);
+            
+            struct Data;
+            std::unique_ptr<Data> _data;
+        };
+        
+        /**
+            Bakes a single target using multiple devices at once.
+         
+            Source and its volume are replicated to each device. Target triangles are split
+            into chunks which devices pull dynamically, so faster devices take more work.
+            Dispatch modes using a texel map instead rasterize all triangles on each device
+            and split texels into chunks, tiled dispatch bins all triangles on each device and
+            splits rows of tiles. Partial textures are merged on the host.
+        */
+        class MultiBaker {
+        public:
+            /** Create an uninitialized multi device baker. */
+            MultiBaker();
+            
+            /** Release all OpenCL resources. */
+            ~MultiBaker();
+            
+            /** Set directory used to cache compiled program binaries. Must be called before init. */
+            void setProgramCacheDirectory(const std::string &dir);
+            
+            /** Set how surface data is made available to devices. Must be called before init. */
+            void setHostMemoryMode(HostMemoryMode mode);
+            
+            /** 
+                Set number of target triangles per chunk, texels for dispatch modes using a 
+                texel map, or tile rows for tiled dispatch. Zero, the default, chooses automatically.
+             */
+            void setChunkSize(int n);
+            
+            /** Enable kernels specialized to the launch constants of a bake, see Baker::setKernelSpecialization. */
+            void setKernelSpecialization(bool enable);
+            
+            /** Set the resolution of the source grid, see Baker::setGridResolution. */
+            void setGridResolution(const Eigen::Vector3i &voxelsPerDimension);
+            
+            /** Set the density targeted by automatic grid resolution, see Baker::setGridDensity. */
+            void setGridDensity(float trianglesPerVoxel);
+            
+            /** Set the acceleration structure built over the source, see Baker::setGridType. */
+            void setGridType(GridType type);
+            
+            /** Initialize the given devices. */
+            bool init(const std::vector<int> &deviceIds);
+            
+            /** Initialize all devices supporting images. */
+            bool init();
+            
+            /** Number of initialized devices. */
+            int deviceCount() const;
+            
+            /** Tune work-group sizes of every device, see Baker::tuneWorkGroupSizes. */
+            bool tuneWorkGroupSizes();
+            
+            /** Build source volume once and upload source to every device. */
+            bool setSource(const Surface &src);
+            
+            /** Bake current source onto target using all devices and wait for completion. */
+            bool bakeTextureMap(const Surface &target, Image<unsigned char> &texture, const BakeParameters &params = BakeParameters());
+            
+        private:
+            MultiBaker(const MultiBaker &);
+            MultiBaker &operator=(const MultiBaker &);
+            
+            struct Data;
+            std::unique_ptr<Data> _data;
+        };
+        
+        /** One-shot bake using a temporary baker. Writes and shows the resulting texture. */
         bool bakeTextureMap(const Surface &src, const Surface &target);
         
     }
-}
\ No newline at end of file
+}
+
+#endif
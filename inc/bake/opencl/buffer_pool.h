@@ -0,0 +1,90 @@
+// This file is part of gpu-bake, a library for baking texture maps on GPUs.
+//
+// Copyright (C) 2015 Christoph Heindl <christoph.heindl@gmail.com>
+//
+// This Source Code Form is subject to the terms of the BSD 3 license.
+// If a copy of the BSD was not distributed with this file, You can obtain
+// one at http://opensource.org/licenses/BSD-3-Clause.
+
+#ifndef BAKE_OPENCL_BUFFER_POOL
+#define BAKE_OPENCL_BUFFER_POOL
+
+#include <bake/opencl/cl.hpp>
+#include <memory>
+
+namespace bake {
+    namespace opencl {
+        
+        /** Pooled device buffer. Returns to its pool when the last reference is dropped. */
+        typedef std::shared_ptr<cl::Buffer> PooledBuffer;
+        
+        /** Pooled device image. Returns to its pool when the last reference is dropped. */
+        typedef std::shared_ptr<cl::Image2D> PooledImage;
+        
+        /** 
+            Size bucketed pool of device memory.
+         
+            Buffer requests are rounded up to the next power of two, so that repeated 
+            bakes of similarly sized meshes reuse the same allocations and memory only 
+            grows when a larger bucket is requested. Requests above 64 MB, or whose bucket
+            would exceed the maximum allocation size of the devices, are pooled by exact
+            size instead. Images are pooled by exact dimensions and format.
+         
+            Unused memory is capped to a quarter of the smallest device memory in the 
+            context. Beyond that the least recently released memory is freed. When an
+            allocation fails for lack of memory, all unused memory is freed and the 
+            allocation retried once.
+         
+            Memory is handed out again as soon as its last handle is dropped. Callers need
+            to keep handles alive until all commands using the memory completed, unless all
+            commands are submitted to the same in-order queue.
+        */
+        class BufferPool {
+        public:
+            /** Pool statistics. */
+            struct Stats {
+                /** Requests served from pooled memory. */
+                int hits;
+                /** Requests that required a new allocation. */
+                int misses;
+                /** Unused buffers and images freed to stay within capacity. */
+                int evictions;
+                /** Total bytes allocated over the lifetime of the pool. */
+                unsigned long long allocatedBytes;
+                /** Bytes of unused memory currently held by the pool. */
+                unsigned long long pooledBytes;
+            };
+            
+            /** Create empty pool. */
+            BufferPool();
+            
+            /** Release pooled memory. Outstanding handles stay valid. */
+            ~BufferPool();
+            
+            /** Set context to allocate from. Clears the pool, memory of outstanding handles is freed on release. */
+            void setContext(const cl::Context &ctx);
+            
+            /** Acquire a buffer holding at least size bytes. */
+            bool acquireBuffer(::size_t size, cl_mem_flags flags, PooledBuffer &b);
+            
+            /** Acquire an image with given dimensions and format. */
+            bool acquireImage(::size_t width, ::size_t height, const cl::ImageFormat &format, cl_mem_flags flags, PooledImage &i);
+            
+            /** Release all currently unused memory. */
+            void clear();
+            
+            /** Access statistics. */
+            Stats stats() const;
+            
+        private:
+            BufferPool(const BufferPool &);
+            BufferPool &operator=(const BufferPool &);
+            
+            struct Data;
+            std::shared_ptr<Data> _data;
+        };
+        
+    }
+}
+
+#endif
@@ -0,0 +1,51 @@
+// This file is part of gpu-bake, a library for baking texture maps on GPUs.
+//
+// Copyright (C) 2015 Christoph Heindl <christoph.heindl@gmail.com>
+//
+// This Source Code Form is subject to the terms of the BSD 3 license.
+// If a copy of the BSD was not distributed with this file, You can obtain
+// one at http://opensource.org/licenses/BSD-3-Clause.
+
+#ifndef BAKE_OPENCL_PROGRAM_CACHE
+#define BAKE_OPENCL_PROGRAM_CACHE
+
+#include <bake/opencl/cl.hpp>
+#include <string>
+
+namespace bake {
+    namespace opencl {
+        
+        /** 
+            Compute the cache key of a program. 
+         
+            The key combines device name, driver version, build options and a hash of 
+            the program source. It is returned as hex string suitable for file names.
+        */
+        std::string programCacheKey(const cl::Device &d, const std::string &source, const std::string &options);
+        
+        /** 
+            Load and build a program from a previously cached binary. 
+         
+            Returns false when no binary is stored under key or the binary is rejected
+            by the driver. In this case the caller should fall back to a source build.
+         */
+        bool loadCachedProgram(const std::string &dir, const std::string &key,
+                               const cl::Context &ctx, const cl::Device &d, const std::string &options,
+                               cl::Program &prg);
+        
+        /** Store the binary of a program built for a single device. */
+        bool storeCachedProgram(const std::string &dir, const std::string &key, const cl::Program &prg);
+        
+        /** 
+            Path of a temporary file next to path. Unique per process and call, so that 
+            concurrent writers of the same cache entry never share a temporary file.
+         */
+        std::string uniqueTempPath(const std::string &path);
+        
+        /** Atomically replace path by the file at tmpPath where the platform allows. Removes tmpPath on failure. */
+        bool moveIntoPlace(const std::string &tmpPath, const std::string &path);
+        
+    }
+}
+
+#endif
@@ -0,0 +1,168 @@
+// This file is part of gpu-bake, a library for baking texture maps on GPUs.
+//
+// Copyright (C) 2015 Christoph Heindl <christoph.heindl@gmail.com>
+//
+// This Source Code Form is subject to the terms of the BSD 3 license.
+// If a copy of the BSD was not distributed with this file, You can obtain
+// one at http://opensource.org/licenses/BSD-3-Clause.
+
+/** Subpixel precision of the rasterizer in bits. Vertices are snapped to this grid. */
+#define RASTER_SUBPIXEL_BITS 8
+#define RASTER_SUBPIXELS (1 << RASTER_SUBPIXEL_BITS)
+
+/** Largest supported samples per texel along one axis. */
+#define RASTER_MAX_SAMPLES 16
+
+/**
+    Fixed-point edge functions of a triangle in texel space.
+    
+    Texels are divided into samples x samples strata. With a single sample it is placed
+    at the texel center, otherwise sample (sx, sy) is jittered within its stratum
+    ((sx, sy) + [0, 1)^2) / samples. Jitter is snapped to subpixels and derived from the
+    global sample index only, so all triangles agree on sample positions. Edge i is
+    opposite of vertex i, its value at a sample is twice the area of the sub-triangle 
+    spanned with that sample and positive inside.
+    
+    Integer arithmetic makes incremental evaluation exact, so together with the fill
+    rule every sample on an edge shared by two triangles is covered by exactly one.
+ */
+typedef struct {
+    /** Edge values at the texel space origin. */
+    long3 origin;
+    /** Edge increments per subpixel in x and y. */
+    long3 stepX;
+    long3 stepY;
+    /** 1 for edges owning samples exactly on them, 0 otherwise. */
+    long3 bias;
+    /** One over twice the triangle area. */
+    float invArea;
+    /** Set when vertices B and C were swapped to make the area positive. */
+    int swapped;
+    /** Samples per texel along each axis. */
+    int samples;
+} Raster;
+
+/** Twice the signed area of triangle (a, b, p). */
+long edgeFunction(long2 a, long2 b, long2 p) {
+    return (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+}
+
+/**
+    Fill rule. Samples exactly on an edge belong to the triangle they would fall into
+    when moved up by an infinitesimal amount and right by an even smaller one. This is
+    the top-left rule for triangles of positive area.
+ */
+long ownsEdge(long2 a, long2 b) {
+    long2 d = b - a;
+    return ((d.x > 0) | ((d.x == 0) & (d.y < 0))) ? 1 : 0;
+}
+
+/**
+    Setup edge functions of triangle with vertices given in texel units. Returns false
+    for degenerate triangles, which cover no sample.
+ */
+bool setupRaster(float2 uvA, float2 uvB, float2 uvC, int samples, Raster *r)
+{
+    // Bound coordinates so that edge values cannot overflow.
+    const float limit = 65536.f;
+    long2 a = convert_long2_rte(clamp(uvA, -limit, limit) * RASTER_SUBPIXELS);
+    long2 b = convert_long2_rte(clamp(uvB, -limit, limit) * RASTER_SUBPIXELS);
+    long2 c = convert_long2_rte(clamp(uvC, -limit, limit) * RASTER_SUBPIXELS);
+    
+    long area = edgeFunction(a, b, c);
+    if (area == 0) {
+        return false;
+    }
+    
+    r->swapped = area < 0;
+    if (r->swapped) {
+        long2 t = b;
+        b = c;
+        c = t;
+        area = -area;
+    }
+    
+    long2 o = (long2)(0);
+    
+    r->origin = (long3)(edgeFunction(b, c, o), edgeFunction(c, a, o), edgeFunction(a, b, o));
+    r->stepX = (long3)(b.y - c.y, c.y - a.y, a.y - b.y);
+    r->stepY = (long3)(c.x - b.x, a.x - c.x, b.x - a.x);
+    r->bias = (long3)(ownsEdge(b, c), ownsEdge(c, a), ownsEdge(a, b));
+    r->invArea = 1.f / (float)area;
+    r->samples = samples;
+    
+    return true;
+}
+
+/** Hash of a global sample index. */
+uint hashSample(int sx, int sy)
+{
+    uint h = ((uint)sx * 0x8da6b343u) ^ ((uint)sy * 0xd8163841u);
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+/** Position of sample (sx, sy) of the sample grid in subpixels. */
+long2 rasterSamplePosition(int samples, int sx, int sy)
+{
+    // Samples have a pitch of RASTER_SUBPIXELS / samples subpixels, which is a power of two.
+    int pitch = RASTER_SUBPIXELS / samples;
+    int2 offset = (int2)(pitch / 2);
+    if (samples > 1) {
+        uint h = hashSample(sx, sy);
+        offset = (int2)((int)(h & (pitch - 1)), (int)((h >> 16) & (pitch - 1)));
+    }
+    return (long2)((long)sx * pitch + offset.x, (long)sy * pitch + offset.y);
+}
+
+/** Edge values at sample (sx, sy) of the sample grid. */
+long3 rasterSample(const Raster *r, int sx, int sy) {
+    long2 p = rasterSamplePosition(r->samples, sx, sy);
+    return r->origin + p.x * r->stepX + p.y * r->stepY;
+}
+
+/** Test if sample with edge values e is covered. */
+bool rasterCovers(const Raster *r, long3 e) {
+    return all(e + r->bias > 0);
+}
+
+/** Test if any sample of texel (x, y) is covered. */
+bool rasterCoversTexel(const Raster *r, int x, int y) {
+    for (int j = 0; j < r->samples; ++j) {
+        for (int i = 0; i < r->samples; ++i) {
+            if (rasterCovers(r, rasterSample(r, x * r->samples + i, y * r->samples + j))) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/** Barycentric weights of vertices A, B, C at sample with edge values e. */
+float3 rasterWeights(const Raster *r, long3 e) {
+    float3 w = convert_float3(e) * r->invArea;
+    return r->swapped ? w.xzy : w;
+}
+
+/**
+    Compute range of texels having samples within the bounding box of a triangle given
+    in texel units. Returns false when the range is empty or any coordinate is not finite,
+    which saturating conversion would otherwise map onto the image border.
+ */
+bool rasterTexelRange(float2 uvA, float2 uvB, float2 uvC, int samples, int imageSize, int2 *pMin, int2 *pMax)
+{
+    if (!all(isfinite(uvA)) | !all(isfinite(uvB)) | !all(isfinite(uvC))) {
+        return false;
+    }
+    
+    // Jittered samples may lie anywhere within their texel.
+    float h = (samples == 1) ? 0.5f : 0.f;
+    *pMin = max(convert_int2_sat(ceil(min(uvA, min(uvB, uvC)) - 1.f + h)), 0);
+    *pMax = min(convert_int2_sat(floor(max(uvA, max(uvB, uvC)) - h)), imageSize - 1);
+    return all(*pMin <= *pMax);
+}
+
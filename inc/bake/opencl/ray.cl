@@ -1,4 +1,3 @@
-
 // This file is part of gpu-bake, a library for baking texture maps on GPUs.
 //
 // Copyright (C) 2015 Christoph Heindl <christoph.heindl@gmail.com>
@@ -69,22 +68,18 @@ float3 intersectRayTriangle(Ray r, float3 a, float3 b, float3 c) {
         return (float3)(-1.f);
 }
 
-void findTriangleInVoxel(
+/** Find closest triangle hit in list of triangles starting at triListIndex and terminated by -1. */
+void findTriangleInList(
     Ray r,
-    int3 voxelIdx,
-    int3 voxelResolution,
+    int triListIndex,
     __global float3 *positions,
-    __global int* voxels,
     __global int* trisInVoxels,
     __private int *triIdx,
     __private float3 *triHit)
 {
-    int id = voxelIdx.x + voxelIdx.y * voxelResolution.x + voxelIdx.z * voxelResolution.x * voxelResolution.y;
-    
-    int triListIndex = voxels[id];
     int triId = trisInVoxels[triListIndex];
     
-    float3 bestHit = float3(FLT_MAX, FLT_MAX, FLT_MAX);
+    float3 bestHit = (float3)(FLT_MAX);
     int bestTri = -1;
     
     while (triId != -1) {
@@ -102,6 +97,110 @@ void findTriangleInVoxel(
     *triHit = bestHit;
 }
 
+/** State of a 3D-DDA walking the voxels of a grid along a ray. */
+typedef struct {
+    int3 voxelIdx;
+    int3 step;
+    float3 tmax;
+    float3 tdelta;
+} Dda;
+
+/** Setup DDA of ray starting inside grid with origin aabbMin. */
+Dda ddaSetup(Ray r, float3 aabbMin, float3 voxelSizes, float3 invVoxelSizes, int3 voxelResolution)
+{
+    Dda dda;
+    
+    float3 voxel = (r.o - aabbMin) * invVoxelSizes;
+    dda.voxelIdx = convert_int3_rtz(voxel);
+    dda.voxelIdx = clamp(dda.voxelIdx, (int3)(0), voxelResolution-1);
+    
+    float3 voxelMin = aabbMin + convert_float3(dda.voxelIdx) * voxelSizes;
+    float3 voxelMax = aabbMin + convert_float3(dda.voxelIdx + (int3)(1)) * voxelSizes;
+    float3 maxNeg = (voxelMin - r.o) * r.invd;
+    float3 maxPos = (voxelMax - r.o) * r.invd;
+    dda.tmax = (r.d < 0.f) ? maxNeg : maxPos;
+    dda.tmax = (fabs(r.d) < 1e-5f) ? (float3)(FLT_MAX) : dda.tmax;
+    dda.step = (r.d < 0) ? (int3)(-1) : (int3)(1);
+    dda.tdelta = fabs(voxelSizes * r.invd);
+    
+    return dda;
+}
+
+/** Test if DDA is still inside its grid. */
+bool ddaInside(const Dda *dda, int3 voxelResolution)
+{
+    return all(dda->voxelIdx >= 0) & all(dda->voxelIdx < voxelResolution);
+}
+
+/** Advance DDA to the next voxel along the ray. */
+void ddaAdvance(Dda *dda)
+{
+    // Instead of ifs:
+    //http://www.csie.ntu.edu.tw/~cyy/courses/rendering/pbrt-2.00/html/grid_8cpp_source.html
+    
+    if (dda->tmax.x < dda->tmax.y)
+    {
+        if (dda->tmax.x < dda->tmax.z)
+        {
+            dda->voxelIdx.x += dda->step.x;
+            dda->tmax.x += dda->tdelta.x;
+        }
+        else
+        {
+            dda->voxelIdx.z += dda->step.z;
+            dda->tmax.z += dda->tdelta.z;
+        }
+    }
+    else
+    {
+        if (dda->tmax.y < dda->tmax.z)
+        {
+            dda->voxelIdx.y += dda->step.y;
+            dda->tmax.y += dda->tdelta.y;
+        }
+        else
+        {
+            dda->voxelIdx.z += dda->step.z;
+            dda->tmax.z += dda->tdelta.z;
+        }
+    }
+}
+
+int voxelIndex(int3 voxelIdx, int3 voxelResolution)
+{
+    return voxelIdx.x + voxelIdx.y * voxelResolution.x + voxelIdx.z * voxelResolution.x * voxelResolution.y;
+}
+
+/** 
+    March the sub-grid stored at header in voxels, which spans the top-level voxel with 
+    bounds aabb. See SurfaceVolume for the layout.
+ */
+void ddaSubGrid(
+    Ray r,
+    float3 aabb[2],
+    int header,
+    __global float3 *positions,
+    __global int* voxels,
+    __global int* trisInVoxels,
+    __private int *triIdx,
+    __private float3 *triHit)
+{
+    float2 tRange = intersectRayBox(r, aabb);
+    r.o += r.d * tRange.x;
+    
+    int3 voxelResolution = (int3)(voxels[header + 0], voxels[header + 1], voxels[header + 2]);
+    float3 voxelSizes = (aabb[1] - aabb[0]) / convert_float3(voxelResolution);
+    __global int* cells = voxels + header + 3;
+    
+    Dda dda = ddaSetup(r, aabb[0], voxelSizes, (float3)(1.f) / voxelSizes, voxelResolution);
+    
+    while ((*triIdx == -1) & ddaInside(&dda, voxelResolution))
+    {
+        findTriangleInList(r, cells[voxelIndex(dda.voxelIdx, voxelResolution)], positions, trisInVoxels, triIdx, triHit);
+        ddaAdvance(&dda);
+    }
+}
+
 void ddaTriangleVolume(
     Ray r,
     float3 aabb[2],
@@ -120,60 +219,29 @@ void ddaTriangleVolume(
     float2 tRange = intersectRayBox(r, aabb);
     if (tRange.x > tRange.y)
         return;
-
+    
     // https://www-s.ks.uiuc.edu/Research/vmd/projects/ece498/raytracing/RTonGPU.pdf
     // Adjust ray to start inside volume.
     r.o += r.d * tRange.x;
     
-    float3 voxel = (r.o - aabb[0]) * invVoxelSizes;
-    int3 voxelIdx = convert_int3_rtz(voxel);
-    voxelIdx = clamp(voxelIdx, (int3)(0), voxelResolution-1);
-
-    float3 voxelMin = aabb[0] + voxelIdx * voxelSizes;
-    float3 voxelMax = aabb[0] + (voxelIdx + (int3)(1)) * voxelSizes;
-    float3 maxNeg = (voxelMin - r.o) * r.invd;
-    float3 maxPos = (voxelMax - r.o) * r.invd;
-    float3 tmax = (r.d < 0.f) ? maxNeg : maxPos;
-    tmax = (fabs(r.d) < 1e-5f) ? (float3)(FLT_MAX) : tmax;
-    int3 step = (r.d < 0) ? (int3)(-1) : (int3)(1);
-    float3 tdelta = fabs(voxelSizes * r.invd);
+    Dda dda = ddaSetup(r, aabb[0], voxelSizes, invVoxelSizes, voxelResolution);
     
-    while ((*triIdx == -1) & all(voxelIdx >= 0) & all(voxelIdx < voxelResolution))
+    while ((*triIdx == -1) & ddaInside(&dda, voxelResolution))
     {
-        
-        // Find intersected triangle
-        findTriangleInVoxel(r, voxelIdx, voxelResolution, positions, voxels, trisInVoxels, triIdx, triHit);
-        
-        // Instead of ifs:
-        //http://www.csie.ntu.edu.tw/~cyy/courses/rendering/pbrt-2.00/html/grid_8cpp_source.html
+        // Find intersected triangle. Negative cells of two-level grids refer to sub-grids,
+        // which are marched in turn.
+        int cell = voxels[voxelIndex(dda.voxelIdx, voxelResolution)];
+        if (cell >= 0) {
+            findTriangleInList(r, cell, positions, trisInVoxels, triIdx, triHit);
+        } else {
+            float3 voxelBounds[2];
+            voxelBounds[0] = aabb[0] + convert_float3(dda.voxelIdx) * voxelSizes;
+            voxelBounds[1] = voxelBounds[0] + voxelSizes;
+            ddaSubGrid(r, voxelBounds, -cell - 1, positions, voxels, trisInVoxels, triIdx, triHit);
+        }
         
         // Advance to the next cell along the ray using 3D-DDA.
-        if (tmax.x < tmax.y)
-        {
-            if (tmax.x < tmax.z)
-            {
-                voxelIdx.x += step.x;
-                tmax.x += tdelta.x;
-            }
-            else
-            {
-                voxelIdx.z += step.z;
-                tmax.z += tdelta.z;
-            }
-        }
-        else
-        {
-            if (tmax.y < tmax.z)
-            {
-                voxelIdx.y += step.y;
-                tmax.y += tdelta.y;
-            }
-            else
-            {
-                voxelIdx.z += step.z;
-                tmax.z += tdelta.z;
-            }
-        }
+        ddaAdvance(&dda);
     }
     
 }
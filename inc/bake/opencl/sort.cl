@@ -0,0 +1,126 @@
+// This file is part of gpu-bake, a library for baking texture maps on GPUs.
+//
+// Copyright (C) 2015 Christoph Heindl <christoph.heindl@gmail.com>
+//
+// This Source Code Form is subject to the terms of the BSD 3 license.
+// If a copy of the BSD was not distributed with this file, You can obtain
+// one at http://opensource.org/licenses/BSD-3-Clause.
+
+/** 
+    Exclusive prefix sum of n counts into offsets and cursors, the latter being a copy
+    to append to. Runs as a single work-group, sums needs one int per work-item.
+ */
+__kernel void scanCounts(
+    __global int* counts,
+    __global int* offsets,
+    __global int* cursors,
+    int n,
+    __local int* sums
+)
+{
+    int lid = get_local_id(0);
+    int size = get_local_size(0);
+    int perItem = (n + size - 1) / size;
+    int begin = min(lid * perItem, n);
+    int end = min(begin + perItem, n);
+    
+    int sum = 0;
+    for (int i = begin; i < end; ++i) {
+        sum += counts[i];
+    }
+    sums[lid] = sum;
+    
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    if (lid == 0) {
+        int acc = 0;
+        for (int i = 0; i < size; ++i) {
+            int s = sums[i];
+            sums[i] = acc;
+            acc += s;
+        }
+    }
+    
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    int acc = sums[lid];
+    for (int i = begin; i < end; ++i) {
+        offsets[i] = acc;
+        cursors[i] = acc;
+        acc += counts[i];
+    }
+}
+
+/** Bits of the key sorted per radix sort pass. */
+#define RADIX_BITS 4
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+/**
+    First step of a radix sort pass. Counts digits of keys per block of one work-group,
+    one key per work-item. Keys at and beyond count are ignored. Histograms are stored 
+    digit major, so that their exclusive prefix sum yields the scatter offsets.
+ */
+__kernel void radixHistogram(
+    __global uint* keys,
+    __global int* count,
+    __global int* histograms,
+    int shift
+)
+{
+    __local int hist[RADIX_BUCKETS];
+    
+    int lid = get_local_id(0);
+    int i = get_global_id(0);
+    
+    if (lid < RADIX_BUCKETS) {
+        hist[lid] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    if (i < *count) {
+        atomic_inc(&hist[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    if (lid < RADIX_BUCKETS) {
+        histograms[lid * get_num_groups(0) + get_group_id(0)] = hist[lid];
+    }
+}
+
+/**
+    Second step of a radix sort pass. Moves keys and values to their scattered offsets.
+    Equal digits keep their order within a block, which keeps the sort stable. digits 
+    needs one int per work-item.
+ */
+__kernel void radixScatter(
+    __global uint* keysIn,
+    __global int* valuesIn,
+    __global uint* keysOut,
+    __global int* valuesOut,
+    __global int* count,
+    __global int* offsets,
+    int shift,
+    __local int* digits
+)
+{
+    int lid = get_local_id(0);
+    int i = get_global_id(0);
+    int n = *count;
+    
+    int d = (i < n) ? (int)((keysIn[i] >> shift) & (RADIX_BUCKETS - 1)) : -1;
+    digits[lid] = d;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    if (i >= n) {
+        return;
+    }
+    
+    int rank = 0;
+    for (int j = 0; j < lid; ++j) {
+        rank += (digits[j] == d) ? 1 : 0;
+    }
+    
+    int dst = offsets[d * get_num_groups(0) + get_group_id(0)] + rank;
+    keysOut[dst] = keysIn[i];
+    valuesOut[dst] = valuesIn[i];
+}
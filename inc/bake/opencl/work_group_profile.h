@@ -0,0 +1,36 @@
+// This file is part of gpu-bake, a library for baking texture maps on GPUs.
+//
+// Copyright (C) 2015 Christoph Heindl <christoph.heindl@gmail.com>
+//
+// This Source Code Form is subject to the terms of the BSD 3 license.
+// If a copy of the BSD was not distributed with this file, You can obtain
+// one at http://opensource.org/licenses/BSD-3-Clause.
+
+#ifndef BAKE_OPENCL_WORK_GROUP_PROFILE
+#define BAKE_OPENCL_WORK_GROUP_PROFILE
+
+#include <map>
+#include <string>
+
+namespace bake {
+    namespace opencl {
+        
+        /** Local work size by kernel name. Kernels not listed or listed with zero leave the choice to the driver. */
+        typedef std::map<std::string, int> WorkGroupProfile;
+        
+        /** 
+            Load the work-group profile stored under key. 
+         
+            Keys are expected to identify device, driver and kernel sources, so that a profile 
+            is never applied to kernels it was not measured for. Returns false when no profile 
+            is stored or it cannot be parsed.
+         */
+        bool loadWorkGroupProfile(const std::string &dir, const std::string &key, WorkGroupProfile &profile);
+        
+        /** Store a work-group profile under key as a small text file. */
+        bool storeWorkGroupProfile(const std::string &dir, const std::string &key, const WorkGroupProfile &profile);
+        
+    }
+}
+
+#endif
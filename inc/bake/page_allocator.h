@@ -0,0 +1,97 @@
+// This file is part of gpu-bake, a library for baking texture maps on GPUs.
+//
+// Copyright (C) 2015 Christoph Heindl <christoph.heindl@gmail.com>
+//
+// This Source Code Form is subject to the terms of the BSD 3 license.
+// If a copy of the BSD was not distributed with this file, You can obtain
+// one at http://opensource.org/licenses/BSD-3-Clause.
+
+#ifndef BAKE_PAGE_ALLOCATOR
+#define BAKE_PAGE_ALLOCATOR
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstdint>
+#include <new>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace bake {
+    
+    /** Alignment of page aligned host memory in bytes. */
+    const std::size_t PageAlignment = 4096;
+    
+    /** Granularity page aligned allocations are padded to in bytes. */
+    const std::size_t PagePadding = 64;
+    
+    /** Round bytes up to a multiple of PagePadding. */
+    inline std::size_t padToPage(std::size_t bytes) {
+        return (bytes + PagePadding - 1) / PagePadding * PagePadding;
+    }
+    
+    /** Test if memory starts on a page boundary. */
+    inline bool isPageAligned(const void *p) {
+        return reinterpret_cast<std::uintptr_t>(p) % PageAlignment == 0;
+    }
+    
+    /**
+        Allocate page aligned memory of at least bytes, padded to a multiple of PagePadding.
+        Returns null on failure.
+     */
+    inline void *allocatePages(std::size_t bytes) {
+        bytes = padToPage(bytes > 0 ? bytes : 1);
+#ifdef _WIN32
+        return _aligned_malloc(bytes, PageAlignment);
+#else
+        void *p = 0;
+        return (posix_memalign(&p, PageAlignment, bytes) == 0) ? p : 0;
+#endif
+    }
+    
+    /** Release memory obtained from allocatePages. */
+    inline void freePages(void *p) {
+#ifdef _WIN32
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+    }
+    
+    /**
+        Allocator of page aligned memory padded to a multiple of PagePadding.
+     
+        Shared memory OpenCL runtimes use host memory in place only when it is aligned
+        and sized this way and silently copy it otherwise.
+     */
+    template<class T>
+    struct PageAllocator {
+        typedef T value_type;
+        
+        PageAllocator() {}
+        
+        template<class U>
+        PageAllocator(const PageAllocator<U> &) {}
+        
+        T *allocate(std::size_t n) {
+            void *p = allocatePages(n * sizeof(T));
+            if (!p) {
+                throw std::bad_alloc();
+            }
+            return static_cast<T*>(p);
+        }
+        
+        void deallocate(T *p, std::size_t) {
+            freePages(p);
+        }
+    };
+    
+    template<class T, class U>
+    bool operator==(const PageAllocator<T> &, const PageAllocator<U> &) { return true; }
+    
+    template<class T, class U>
+    bool operator!=(const PageAllocator<T> &, const PageAllocator<U> &) { return false; }
+    
+}
+
+#endif
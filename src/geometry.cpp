@@ -7,9 +7,11 @@
 // one at http://opensource.org/licenses/BSD-3-Clause.
 
 #include <bake/geometry.h>
-#include <unordered_map>
-#include <set>
+#include <bake/log.h>
 #include <iostream>
+#include <thread>
+#include <algorithm>
+#include <cmath>
 
 namespace bake {
     
@@ -26,6 +28,39 @@ namespace bake {
         return box;
     }
     
+    Eigen::AlignedBox3f computeVolumeBounds(const Surface::VertexPositionMatrix &m)
+    {
+        Eigen::AlignedBox3f box = computeBoundingBox(m);
+        
+        // When the bounds are of zero-length in any dimension, we
+        // artificially enlarge the bounds to avoid numerical issues.
+        if (box.volume() == 0.f) {
+            box.min() -= Eigen::Vector3f::Constant(0.1f);
+            box.max() += Eigen::Vector3f::Constant(0.1f);
+        }
+        return box;
+    }
+    
+    Eigen::Vector3i chooseVoxelsPerDimension(const Eigen::AlignedBox3f &bounds, int nTriangles, float trianglesPerVoxel, int maxPerDimension)
+    {
+        const Eigen::Vector3f extent = bounds.diagonal();
+        const float volume = extent.prod();
+        if (!(volume > 0.f) || nTriangles <= 0 || !(trianglesPerVoxel > 0.f)) {
+            return Eigen::Vector3i::Ones();
+        }
+        
+        // Edge length of cubic voxels giving the requested number of voxels.
+        const float nVoxels = nTriangles / trianglesPerVoxel;
+        const float voxelsPerUnit = std::cbrt(nVoxels / volume);
+        
+        Eigen::Vector3i res;
+        for (int i = 0; i < 3; ++i) {
+            const float n = std::round(extent[i] * voxelsPerUnit);
+            res[i] = static_cast<int>(std::max(1.f, std::min(n, static_cast<float>(maxPerDimension))));
+        }
+        return res;
+    }
+    
     Eigen::Affine3f buildWorldToVoxel(const Eigen::Vector3f &origin, const Eigen::Vector3f &voxelSizes)
     {
         Eigen::Affine3f a;
@@ -46,67 +81,364 @@ namespace bake {
         return idx.x() + idx.y() * res.x() + idx.z() * res.x() * res.y();
     }
     
-    bool buildSurfaceVolume(const Surface &s, const Eigen::Vector3i &voxelsPerDimension, SurfaceVolume &v)
+    /** 
+        Voxel range covered by the bounding box of triangle tri. Clamped to the grid, as 
+        vertices on the upper bounds map to one past the last voxel.
+     */
+    template<class Points>
+    Eigen::AlignedBox3i triangleVoxels(const Eigen::Affine3f &wl, const Eigen::Vector3i &res, const Points &points, int tri)
     {
-        v.bounds = computeBoundingBox(s.vertexPositions);
+        Eigen::AlignedBox3i primBox;
+        primBox.extend(toVoxel(wl, points.col(tri * 3 + 0)));
+        primBox.extend(toVoxel(wl, points.col(tri * 3 + 1)));
+        primBox.extend(toVoxel(wl, points.col(tri * 3 + 2)));
         
-        // When the bounds are of zero-length in any dimension, we
-        // artificially enlarge the bounds to avoid numerical issues.
-        if (v.bounds.volume() == 0.f) {
-            v.bounds.min() -= Eigen::Vector3f::Constant(0.1f);
-            v.bounds.max() += Eigen::Vector3f::Constant(0.1f);
+        Eigen::AlignedBox3i grid(Eigen::Vector3i::Zero(), res - Eigen::Vector3i::Ones());
+        return primBox.intersection(grid);
+    }
+    
+    /** 
+        Exact triangle / voxel overlap by the separating axis theorem in voxel units
+        (Akenine-Moeller, Fast 3D Triangle-Box Overlap Testing). Boxes are slightly
+        enlarged, so that rounding keeps voxels that are merely touched.
+     */
+    struct TriangleVoxelTest {
+        Eigen::Vector3f a, b, c;
+        Eigen::Vector3f edges[3];
+        Eigen::Vector3f normal;
+        
+        TriangleVoxelTest(const Eigen::Vector3f &a_, const Eigen::Vector3f &b_, const Eigen::Vector3f &c_)
+            : a(a_), b(b_), c(c_)
+        {
+            edges[0] = b - a;
+            edges[1] = c - b;
+            edges[2] = a - c;
+            normal = edges[0].cross(edges[1]);
         }
         
+        /** Test if triangle projected onto axis is separated from box at center by half size h. */
+        static bool separated(const Eigen::Vector3f &axis, const Eigen::Vector3f &a, const Eigen::Vector3f &b, const Eigen::Vector3f &c, float h)
+        {
+            const float pa = axis.dot(a);
+            const float pb = axis.dot(b);
+            const float pc = axis.dot(c);
+            const float r = h * axis.cwiseAbs().sum();
+            return std::min(pa, std::min(pb, pc)) > r || std::max(pa, std::max(pb, pc)) < -r;
+        }
+        
+        /** Test if voxel is overlapped. Assumes voxel is within the bounds of the triangle. */
+        bool overlaps(const Eigen::Vector3i &voxel) const
+        {
+            const float h = 0.5f + 1e-3f;
+            const Eigen::Vector3f center = voxel.cast<float>() + Eigen::Vector3f::Constant(0.5f);
+            const Eigen::Vector3f ra = a - center;
+            const Eigen::Vector3f rb = b - center;
+            const Eigen::Vector3f rc = c - center;
+            
+            // Triangle plane
+            if (std::abs(normal.dot(ra)) > h * normal.cwiseAbs().sum()) {
+                return false;
+            }
+            
+            // Cross products of edges and box axes. Box axes are covered by the bounds.
+            for (int e = 0; e < 3; ++e) {
+                for (int i = 0; i < 3; ++i) {
+                    if (separated(edges[e].cross(Eigen::Vector3f::Unit(i)), ra, rb, rc, h)) {
+                        return false;
+                    }
+                }
+            }
+            
+            return true;
+        }
+    };
+    
+    /** 
+        Call f with the index of every voxel of a grid with resolution res overlapped by 
+        triangle tri, wl mapping world to voxel coordinates. Returns the number of voxels 
+        within the bounds of the triangle that are not overlapped.
+     */
+    template<class Points, class F>
+    int forEachTriangleVoxel(const Eigen::Affine3f &wl, const Eigen::Vector3i &res, const Points &points, int tri, const F &f)
+    {
+        Eigen::AlignedBox3i primBox = triangleVoxels(wl, res, points, tri);
+        if (primBox.isEmpty()) {
+            return 0;
+        }
+        
+        // A single voxel is always overlapped.
+        if (primBox.min() == primBox.max()) {
+            f(toIndex(primBox.min(), res));
+            return 0;
+        }
+        
+        TriangleVoxelTest test(wl * Eigen::Vector3f(points.col(tri * 3 + 0)),
+                               wl * Eigen::Vector3f(points.col(tri * 3 + 1)),
+                               wl * Eigen::Vector3f(points.col(tri * 3 + 2)));
+        
+        int culled = 0;
+        for (int z = primBox.min().z(); z <= primBox.max().z(); ++z)
+            for (int y = primBox.min().y(); y <= primBox.max().y(); ++y)
+                for (int x = primBox.min().x(); x <= primBox.max().x(); ++x) {
+                    const Eigen::Vector3i voxel(x, y, z);
+                    if (test.overlaps(voxel)) {
+                        f(toIndex(voxel, res));
+                    } else {
+                        ++culled;
+                    }
+                }
+        return culled;
+    }
+    
+    /** 
+        Number of threads used to build a grid. Small inputs are not worth the overhead and 
+        per-thread cell counts are bounded to limit memory.
+     */
+    int buildThreadCount(int nTriangles, int nVoxels)
+    {
+        const int minTrianglesPerThread = 16384;
+        const size_t maxCounts = size_t(1) << 26;
+        
+        int n = static_cast<int>(std::thread::hardware_concurrency());
+        n = std::min(n, nTriangles / minTrianglesPerThread);
+        n = std::min(n, static_cast<int>(maxCounts / std::max(nVoxels, 1)));
+        return std::max(n, 1);
+    }
+    
+    /** Split [0, n) into nThreads contiguous ranges and call f(t, begin, end) for each in parallel. */
+    template<class F>
+    void parallelRanges(int n, int nThreads, const F &f)
+    {
+        if (nThreads == 1) {
+            f(0, 0, n);
+            return;
+        }
+        
+        std::vector<std::thread> threads;
+        for (int t = 0; t < nThreads; ++t) {
+            const int begin = static_cast<int>(static_cast<long long>(n) * t / nThreads);
+            const int end = static_cast<int>(static_cast<long long>(n) * (t + 1) / nThreads);
+            threads.push_back(std::thread(f, t, begin, end));
+        }
+        
+        for (size_t i = 0; i < threads.size(); ++i) {
+            threads[i].join();
+        }
+    }
+    
+    bool buildSurfaceVolume(const Surface &s, const Eigen::Vector3i &voxelsPerDimension, SurfaceVolume &v, int threads)
+    {
+        v.bounds = computeVolumeBounds(s.vertexPositions);
+        
         v.voxelsPerDimension = voxelsPerDimension;
         v.voxelSizes = v.bounds.diagonal().array() / voxelsPerDimension.cast<float>().array();
         v.toVoxel = buildWorldToVoxel(v.bounds.min(), v.voxelSizes);
         
-        // Loop over triangles and build a sparse map of voxel -> triangles
+        // Two passes over triangles: count references per cell, then fill them in. Cells
+        // are laid out consecutively, each followed by its terminator. Triangles are split 
+        // into one contiguous range per thread and every thread owns a slice of each cell 
+        // following the slices of threads with lower triangles. Lists thus come out sorted 
+        // and identical to a serial build.
+        auto &points = s.vertexPositions.topRows(3);
+        
+        const int ntri = static_cast<int>(s.vertexPositions.cols() / 3);
+        const int nVoxels = v.voxelsPerDimension.x() * v.voxelsPerDimension.y() * v.voxelsPerDimension.z();
+        const int nThreads = (threads > 0) ? threads : buildThreadCount(ntri, nVoxels);
+        
+        // Counts per thread and cell, later turned into write positions.
+        std::vector<int> offsets(static_cast<size_t>(nThreads) * nVoxels, 0);
+        std::vector<long long> culled(nThreads, 0);
+        
+        parallelRanges(ntri, nThreads, [&](int t, int begin, int end) {
+            int *counts = &offsets[static_cast<size_t>(t) * nVoxels];
+            for (int tri = begin; tri < end; ++tri) {
+                culled[t] += forEachTriangleVoxel(v.toVoxel, v.voxelsPerDimension, points, tri, [counts](int idx) { ++counts[idx]; });
+            }
+        });
+        
+        // Exclusive prefix sum over cells, computed per range of cells first and then 
+        // offset by the totals of preceding ranges.
+        std::vector<int> rangeTotals(nThreads + 1, 0);
+        
+        parallelRanges(nVoxels, nThreads, [&](int t, int begin, int end) {
+            int total = 0;
+            for (int idx = begin; idx < end; ++idx) {
+                for (int i = 0; i < nThreads; ++i) {
+                    total += offsets[static_cast<size_t>(i) * nVoxels + idx];
+                }
+                total += 1;
+            }
+            rangeTotals[t + 1] = total;
+        });
+        
+        for (int t = 0; t < nThreads; ++t) {
+            rangeTotals[t + 1] += rangeTotals[t];
+        }
+        
+        v.cells.resize(nVoxels);
+        
+        parallelRanges(nVoxels, nThreads, [&](int t, int begin, int end) {
+            int start = rangeTotals[t];
+            for (int idx = begin; idx < end; ++idx) {
+                v.cells[idx] = start;
+                for (int i = 0; i < nThreads; ++i) {
+                    int &o = offsets[static_cast<size_t>(i) * nVoxels + idx];
+                    const int count = o;
+                    o = start;
+                    start += count;
+                }
+                start += 1;
+            }
+        });
+        
+        v.triangleIndices.assign(rangeTotals[nThreads], -1);
+        
+        parallelRanges(ntri, nThreads, [&](int t, int begin, int end) {
+            int *cursor = &offsets[static_cast<size_t>(t) * nVoxels];
+            int *indices = v.triangleIndices.data();
+            for (int tri = begin; tri < end; ++tri) {
+                forEachTriangleVoxel(v.toVoxel, v.voxelsPerDimension, points, tri, [cursor, indices, tri](int idx) { indices[cursor[idx]++] = tri; });
+            }
+        });
+        
+        long long nCulled = 0;
+        for (int t = 0; t < nThreads; ++t) {
+            nCulled += culled[t];
+        }
+        
+        const long long nReferences = static_cast<long long>(v.triangleIndices.size()) - nVoxels;
+        BAKE_LOG("Grid has %lld triangle references, overlap test removed %lld.", nReferences, nCulled);
+        
+        return true;
+    }
+    
+    bool buildTwoLevelSurfaceVolume(const Surface &s, const Eigen::Vector3i &voxelsPerDimension, float trianglesPerVoxel, SurfaceVolume &v, int threads)
+    {
+        SurfaceVolume top;
+        if (!buildSurfaceVolume(s, voxelsPerDimension, top, threads)) {
+            return false;
+        }
+        
+        // Largest sub-grid resolution per dimension.
+        const int maxSubVoxels = 16;
         
-        std::unordered_map<int, std::set<int> > voxelsToTri;
         auto &points = s.vertexPositions.topRows(3);
         
+        const Eigen::Vector3i &res = top.voxelsPerDimension;
         const int ntri = static_cast<int>(s.vertexPositions.cols() / 3);
-        for (int tri = 0; tri < ntri; ++tri) {
-            
-            Eigen::AlignedBox3i primBox;
-            primBox.extend(toVoxel(v.toVoxel, points.col(tri * 3 + 0)));
-            primBox.extend(toVoxel(v.toVoxel, points.col(tri * 3 + 1)));
-            primBox.extend(toVoxel(v.toVoxel, points.col(tri * 3 + 2)));
+        const int nVoxels = res.x() * res.y() * res.z();
+        const int nThreads = (threads > 0) ? threads : buildThreadCount(ntri, nVoxels);
+        
+        // Top cells are split into one range per thread. Each thread emits top entries,
+        // sub-grids and triangle lists with local offsets, which are rebased when
+        // concatenating in order, so the result does not depend on the thread count.
+        struct Part {
+            std::vector<int> top;
+            std::vector<int> sub;
+            std::vector<int> tris;
+        };
+        std::vector<Part> parts(nThreads);
+        
+        parallelRanges(nVoxels, nThreads, [&](int t, int begin, int end) {
+            Part &p = parts[t];
+            std::vector<int> cursor;
             
-            for (int z = primBox.min().z(); z <= primBox.max().z(); ++z)
-                for (int y = primBox.min().y(); y <= primBox.max().y(); ++y)
-                    for (int x = primBox.min().x(); x <= primBox.max().x(); ++x)
-                        voxelsToTri[toIndex(Eigen::Vector3i(x, y, z), v.voxelsPerDimension)].insert(tri);
-        }
+            for (int idx = begin; idx < end; ++idx) {
+                const int first = top.cells[idx];
+                int n = 0;
+                while (top.triangleIndices[first + n] != -1) {
+                    ++n;
+                }
+                
+                const Eigen::Vector3i voxel(idx % res.x(), (idx / res.x()) % res.y(), idx / (res.x() * res.y()));
+                const Eigen::Vector3f cellMin = top.bounds.min() + voxel.cast<float>().cwiseProduct(top.voxelSizes);
+                const Eigen::Vector3i subRes = chooseVoxelsPerDimension(Eigen::AlignedBox3f(cellMin, cellMin + top.voxelSizes), n, trianglesPerVoxel, maxSubVoxels);
+                const int nSub = subRes.x() * subRes.y() * subRes.z();
+                
+                if (nSub == 1) {
+                    p.top.push_back(static_cast<int>(p.tris.size()));
+                    p.tris.insert(p.tris.end(), top.triangleIndices.begin() + first, top.triangleIndices.begin() + first + n + 1);
+                    continue;
+                }
+                
+                // Sub-grid header followed by its cells.
+                p.top.push_back(-static_cast<int>(p.sub.size()) - 1);
+                p.sub.push_back(subRes.x());
+                p.sub.push_back(subRes.y());
+                p.sub.push_back(subRes.z());
+                const size_t subFirst = p.sub.size();
+                p.sub.resize(subFirst + nSub);
+                
+                const Eigen::Affine3f wl = buildWorldToVoxel(cellMin, top.voxelSizes.cwiseQuotient(subRes.cast<float>()));
+                
+                cursor.assign(nSub, 0);
+                for (int i = first; i < first + n; ++i) {
+                    forEachTriangleVoxel(wl, subRes, points, top.triangleIndices[i], [&cursor](int c) { ++cursor[c]; });
+                }
+                
+                int start = static_cast<int>(p.tris.size());
+                for (int c = 0; c < nSub; ++c) {
+                    const int count = cursor[c];
+                    p.sub[subFirst + c] = start;
+                    cursor[c] = start;
+                    start += count + 1;
+                }
+                p.tris.resize(start, -1);
+                
+                for (int i = first; i < first + n; ++i) {
+                    const int tri = top.triangleIndices[i];
+                    forEachTriangleVoxel(wl, subRes, points, tri, [&cursor, &p, tri](int c) { p.tris[cursor[c]++] = tri; });
+                }
+            }
+        });
         
-        // Loop over all cells and update output structures.
+        v.bounds = top.bounds;
+        v.toVoxel = top.toVoxel;
+        v.voxelsPerDimension = top.voxelsPerDimension;
+        v.voxelSizes = top.voxelSizes;
         v.cells.clear();
         v.triangleIndices.clear();
         
-        const int nVoxels = v.voxelsPerDimension.x() * v.voxelsPerDimension.y() * v.voxelsPerDimension.z();
-
-        for (int idx = 0; idx < nVoxels; ++idx) {
-            // Start index in triIndices
-            v.cells.push_back(static_cast<int>(v.triangleIndices.size()));
+        // Sub-grids are placed after all top cells.
+        std::vector<int> subCells;
+        int nSubGrids = 0;
+        
+        for (int t = 0; t < nThreads; ++t) {
+            const Part &p = parts[t];
+            const int triBase = static_cast<int>(v.triangleIndices.size());
+            const int subBase = nVoxels + static_cast<int>(subCells.size());
+            
+            for (size_t i = 0; i < p.top.size(); ++i) {
+                const int e = p.top[i];
+                v.cells.push_back(e >= 0 ? e + triBase : e - subBase);
+            }
             
-            // When cell has triangles add them to list
-            auto iter = voxelsToTri.find(idx);
-            if (iter != voxelsToTri.end()) {
-                v.triangleIndices.insert(v.triangleIndices.end(), iter->second.begin(), iter->second.end());
+            size_t i = 0;
+            while (i < p.sub.size()) {
+                const int nSub = p.sub[i] * p.sub[i + 1] * p.sub[i + 2];
+                subCells.insert(subCells.end(), p.sub.begin() + i, p.sub.begin() + i + 3);
+                for (int c = 0; c < nSub; ++c) {
+                    subCells.push_back(p.sub[i + 3 + c] + triBase);
+                }
+                i += 3 + nSub;
+                ++nSubGrids;
             }
             
-            // Terminal
-            v.triangleIndices.push_back(-1);
+            v.triangleIndices.insert(v.triangleIndices.end(), p.tris.begin(), p.tris.end());
         }
         
+        v.cells.insert(v.cells.end(), subCells.begin(), subCells.end());
+        
+        BAKE_LOG("Two-level grid has %d sub-grids, %d cells and %d triangle references.", nSubGrids, 
+                 static_cast<int>(v.cells.size()), static_cast<int>(v.triangleIndices.size() - v.cells.size()) + nSubGrids * 4);
+        
         return true;
     }
-
-
-
-
     
     
-
+    
+    
+    
+    
+    
 }
\ No newline at end of file
@@ -8,13 +8,25 @@
 
 #include <bake/opencl/bake.h>
 #include <bake/opencl/cl.hpp>
-#include <bake/stringify.h>
+#include <bake/opencl/program_cache.h>
+#include <bake/opencl/buffer_pool.h>
+#include <bake/opencl/work_group_profile.h>
+#include <bake/opencl/kernel_sources.h>
 #include <bake/geometry.h>
+#include <bake/page_allocator.h>
 #include <bake/log.h>
 #include <bake/image.h>
-#include <bake/config.h>
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <map>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
 #include <opencv2/opencv.hpp>
 
 #define ASSERT_OPENCL(clerr, msg)           \
@@ -48,16 +60,96 @@ namespace cl {
 namespace bake {
     namespace opencl {
         
+        /** 
+            Kernels taking launch constants as arguments. Variants of the program built with 
+            these constants defined let the compiler fold them.
+         */
+        struct KernelVariant {
+            cl::Program prg;
+            cl::Kernel kBakeTexture;
+            cl::Kernel kRasterizeTexels;
+            cl::Kernel kBakeTexels;
+            cl::Kernel kBakeTexelsPersistent;
+            cl::Kernel kGenerateRays;
+            cl::Kernel kTraceRays;
+            cl::Kernel kShadeTexels;
+            cl::Kernel kBakeTiles;
+        };
+        
         /** OpenCL context. */
         struct OCL {
             cl::Context ctx;
             cl::Device d;
             cl::Platform p;
+            /** Queue for kernels. */
             cl::CommandQueue q;
+            /** Queue for target uploads. */
+            cl::CommandQueue qu;
+            /** Queue for texture readbacks. Separate from uploads, as a readback waiting 
+                for its kernel would otherwise hold back the upload of the next target. */
+            cl::CommandQueue qr;
             cl::Program prg;
             cl::Kernel kBakeTexture;
+            cl::Kernel kResolveTexels;
+            cl::Kernel kDilateTexels;
+            cl::Kernel kFillInt;
+            cl::Kernel kRasterizeTexels;
+            cl::Kernel kCompactTexels;
+            cl::Kernel kBakeTexels;
+            cl::Kernel kBakeTexelsPersistent;
+            cl::Kernel kGenerateRays;
+            cl::Kernel kTraceRays;
+            cl::Kernel kShadeTexels;
+            cl::Kernel kCountTileTriangles;
+            cl::Kernel kScanCounts;
+            cl::Kernel kBinTileTriangles;
+            cl::Kernel kBakeTiles;
+            cl::Kernel kComputeRayKeys;
+            cl::Kernel kRadixHistogram;
+            cl::Kernel kRadixScatter;
+            BufferPool pool;
+            /** When set, host memory is used in place instead of being copied to the device. */
+            bool zeroCopy;
+            /** True when the device runs tile work-groups. */
+            bool tilesSupported;
+            /** Work-group size of the count scan. */
+            int scanGroupSize;
+            /** True when the device runs radix sort work-groups. */
+            bool sortSupported;
+            /** Work-group size of radix sort kernels, which is the block size sorted by one group. */
+            int radixGroupSize;
+            /** Work-group size and number of work-groups of the persistent kernel. */
+            int persistentGroupSize;
+            int persistentGroups;
+            /** Directory of cached program binaries, empty when caching is disabled. */
+            std::string cacheDir;
+            /** When set, bakes use kernel variants specialized to their launch constants. */
+            bool specialize;
+            /** Kernels of the generic program. */
+            KernelVariant generic;
+            /** Specialized kernel variants by build options, each built on first use. */
+            std::map<std::string, KernelVariant> variants;
+            /** Tuned local work sizes and the key the profile is stored under. */
+            WorkGroupProfile localSizes;
+            std::string profileKey;
+            
+            OCL() : zeroCopy(false), tilesSupported(false), scanGroupSize(1), sortSupported(false), radixGroupSize(1), persistentGroupSize(1), persistentGroups(1), specialize(false) {}
         };
         
+        /** Edge length of texture tiles in texels. Needs to match TILE_SIZE in bake.cl. */
+        const int BakeTileSize = 16;
+        
+        /** 
+            Radix sort digit bits, buckets per pass and number of passes. Need to match 
+            RADIX_BITS in sort.cl and the 24 bit keys of computeRayKeys in bake.cl.
+         */
+        const int RadixBits = 4;
+        const int RadixBuckets = 1 << RadixBits;
+        const int RadixPasses = 24 / RadixBits;
+        
+        /** Rays per wave of the wavefront pipeline. A multiple of all supported samples per texel. */
+        const int WavefrontRays = 1 << 20;
+        
         /** Create an argument from c-style array */
         template<class T>
         inline cl::detail::carray_arg carray(const T* ptr, ::size_t n) {
@@ -67,36 +159,203 @@ namespace bake {
             return c;
         }
         
-        /** Initialize OpenCL relevant structures. */
-        bool initOpenCL(OCL &c, int deviceId) {
+        /** Enumerate all devices of all platforms. The position in devices defines the device id. */
+        void enumerateDevices(std::vector<cl::Platform> &platforms, std::vector<cl::Device> &devices) {
+            platforms.clear();
+            devices.clear();
+            
+            std::vector<cl::Platform> ps;
+            cl::Platform::get(&ps);
+            
+            for (auto piter = ps.begin(); piter != ps.end(); ++piter) {
+                std::vector<cl::Device> ds;
+                piter->getDevices(CL_DEVICE_TYPE_ALL, &ds);
+                for (auto diter = ds.begin(); diter != ds.end(); ++diter) {
+                    platforms.push_back(*piter);
+                    devices.push_back(*diter);
+                }
+            }
+        }
+        
+        std::vector<DeviceInfo> listDevices() {
             std::vector<cl::Platform> platforms;
-            cl::Platform::get(&platforms);
+            std::vector<cl::Device> devices;
+            enumerateDevices(platforms, devices);
+            
+            std::vector<DeviceInfo> infos;
+            for (size_t i = 0; i < devices.size(); ++i) {
+                const cl::Device &d = devices[i];
+                
+                DeviceInfo info;
+                info.id = static_cast<int>(i);
+                info.name = d.getInfo<CL_DEVICE_NAME>();
+                info.vendor = d.getInfo<CL_DEVICE_VENDOR>();
+                info.platformName = platforms[i].getInfo<CL_PLATFORM_NAME>();
+                info.driverVersion = d.getInfo<CL_DRIVER_VERSION>();
+                
+                const cl_device_type t = d.getInfo<CL_DEVICE_TYPE>();
+                if (t & CL_DEVICE_TYPE_GPU) {
+                    info.type = DeviceTypeGPU;
+                } else if (t & CL_DEVICE_TYPE_CPU) {
+                    info.type = DeviceTypeCPU;
+                } else if (t & CL_DEVICE_TYPE_ACCELERATOR) {
+                    info.type = DeviceTypeAccelerator;
+                } else {
+                    info.type = DeviceTypeOther;
+                }
+                
+                info.computeUnits = static_cast<int>(d.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>());
+                info.maxClockFrequency = static_cast<int>(d.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>());
+                info.globalMemorySize = d.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+                info.maxAllocationSize = d.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+                info.imageSupport = d.getInfo<CL_DEVICE_IMAGE_SUPPORT>() == CL_TRUE;
+                info.hostUnifiedMemory = d.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE;
+                
+                infos.push_back(info);
+            }
+            
+            return infos;
+        }
+        
+        int selectDevice(const std::vector<DeviceInfo> &devices, DevicePolicy policy) {
+            int best = -1;
+            double bestScore = 0.0;
+            
+            for (auto iter = devices.begin(); iter != devices.end(); ++iter) {
+                // Baking writes to image objects.
+                if (!iter->imageSupport) {
+                    continue;
+                }
+                
+                double score = 0.0;
+                switch (policy) {
+                    case SelectMostComputeUnits:
+                        score = iter->computeUnits;
+                        break;
+                    case SelectLargestMemory:
+                        score = static_cast<double>(iter->globalMemorySize);
+                        break;
+                    case SelectHighestThroughput:
+                        score = static_cast<double>(iter->computeUnits) * std::max(iter->maxClockFrequency, 1);
+                        break;
+                }
+                
+                if (best == -1 || score > bestScore) {
+                    best = iter->id;
+                    bestScore = score;
+                }
+            }
             
-            if (platforms.empty()) {
-                BAKE_LOG("No OpenCL compatible platforms found.");
+            return best;
+        }
+        
+        /** Create kernel of program by name. */
+        bool createKernel(const cl::Program &prg, const char *name, cl::Kernel &k)
+        {
+            cl_int err;
+            k = cl::Kernel(prg, name, &err);
+            if (err != CL_SUCCESS) {
+                BAKE_LOG("Failed to locate kernel %s", name);
                 return false;
             }
+            return true;
+        }
+        
+        /** Create the kernels of a program variant. */
+        bool createVariantKernels(const cl::Program &prg, KernelVariant &v)
+        {
+            v.prg = prg;
+            return createKernel(prg, "bakeTextureMap", v.kBakeTexture) &&
+                   createKernel(prg, "rasterizeTexels", v.kRasterizeTexels) &&
+                   createKernel(prg, "bakeTexels", v.kBakeTexels) &&
+                   createKernel(prg, "bakeTexelsPersistent", v.kBakeTexelsPersistent) &&
+                   createKernel(prg, "generateRays", v.kGenerateRays) &&
+                   createKernel(prg, "traceRays", v.kTraceRays) &&
+                   createKernel(prg, "shadeTexels", v.kShadeTexels) &&
+                   createKernel(prg, "bakeTiles", v.kBakeTiles);
+        }
+        
+        /** Make the kernels of a variant the ones used by subsequent enqueues. */
+        void useVariant(OCL &c, const KernelVariant &v)
+        {
+            c.kBakeTexture = v.kBakeTexture;
+            c.kRasterizeTexels = v.kRasterizeTexels;
+            c.kBakeTexels = v.kBakeTexels;
+            c.kBakeTexelsPersistent = v.kBakeTexelsPersistent;
+            c.kGenerateRays = v.kGenerateRays;
+            c.kTraceRays = v.kTraceRays;
+            c.kShadeTexels = v.kShadeTexels;
+            c.kBakeTiles = v.kBakeTiles;
+        }
+        
+        /** Program source embedded at build time. */
+        std::string programSource()
+        {
+            // Sources are concatenated as ray.cl, raster.cl and sort.cl are dependencies of bake.cl
+            std::string source;
+            source += reinterpret_cast<const char*>(kernels::ray);
+            source += reinterpret_cast<const char*>(kernels::raster);
+            source += reinterpret_cast<const char*>(kernels::sort);
+            source += reinterpret_cast<const char*>(kernels::bake);
+            return source;
+        }
+        
+        /** Build the program with the given options. Uses the binary cache when enabled. */
+        bool buildProgram(OCL &c, const std::string &options, cl::Program &prg)
+        {
+            const std::string source = programSource();
             
-            bool deviceFound = false;
-            int id = 0;
-            for (auto piter = platforms.begin(); piter != platforms.end(); ++piter) {
-                std::vector<cl::Device> devices;
-                piter->getDevices(CL_DEVICE_TYPE_ALL, &devices);
-                for (auto citer = devices.begin(); citer != devices.end(); ++citer) {
-                    BAKE_LOG("Found device #%d: %s", id, citer->getInfo<CL_DEVICE_NAME>().c_str());
-                    if (id == deviceId) {
-                        c.p = *piter;
-                        c.d = *citer;
-                        deviceFound = true;
-                    }
-                    ++id;
+            std::string key;
+            if (!c.cacheDir.empty()) {
+                key = programCacheKey(c.d, source, options);
+                if (loadCachedProgram(c.cacheDir, key, c.ctx, c.d, options, prg)) {
+                    BAKE_LOG("Loaded OpenCL program %s from cache.", key.c_str());
+                    return true;
                 }
             }
             
-            if (!deviceFound) {
-                BAKE_LOG("Requested device not found.");
+            std::vector<cl::Device> devs(1, c.d);
+            cl::Program::Sources sources;
+            sources.push_back(std::make_pair(source.c_str(), source.size()));
+            
+            cl_int err;
+            prg = cl::Program(c.ctx, sources, &err);
+            err = prg.build(devs, options.c_str());
+            if (err != CL_SUCCESS) {
+                BAKE_LOG("Failed to build OpenCL program: %s", prg.getBuildInfo<CL_PROGRAM_BUILD_LOG>(c.d).c_str());
+                return false;
+            }
+            
+            if (!c.cacheDir.empty() && !storeCachedProgram(c.cacheDir, key, prg)) {
+                BAKE_LOG("Failed to store OpenCL program in cache.");
+            }
+            
+            return true;
+        }
+        
+        /** Initialize OpenCL relevant structures. */
+        bool initOpenCL(OCL &c, int deviceId, const std::string &cacheDir) {
+            std::vector<cl::Platform> platforms;
+            std::vector<cl::Device> devices;
+            enumerateDevices(platforms, devices);
+            
+            if (devices.empty()) {
+                BAKE_LOG("No OpenCL compatible devices found.");
+                return false;
+            }
+            
+            for (size_t i = 0; i < devices.size(); ++i) {
+                BAKE_LOG("Found device #%d: %s", (int)i, devices[i].getInfo<CL_DEVICE_NAME>().c_str());
+            }
+            
+            if (deviceId < 0 || deviceId >= (int)devices.size()) {
+                BAKE_LOG("Requested device #%d not found.", deviceId);
+                return false;
             }
             
+            c.p = platforms[deviceId];
+            c.d = devices[deviceId];
+            
             BAKE_LOG("Using device %s.", c.d.getInfo<CL_DEVICE_NAME>().c_str());
             
             cl_context_properties properties[] = { CL_CONTEXT_PLATFORM, (cl_context_properties)(c.p)(), 0};
@@ -107,182 +366,2239 @@ namespace bake {
             c.ctx = cl::Context(devs, properties, 0, 0, &err);
             if (err != CL_SUCCESS) {
                 BAKE_LOG("Failed to create OpenCL context.");
+                return false;
             }
             
-            c.q = cl::CommandQueue(c.ctx, c.d, 0, &err);
+            // Profiling is enabled for pipeline statistics.
+            c.q = cl::CommandQueue(c.ctx, c.d, CL_QUEUE_PROFILING_ENABLE, &err);
             if (err != CL_SUCCESS) {
                 BAKE_LOG("Failed to create OpenCL queue.");
+                return false;
             }
             
-            // Build program
-            std::string clSourceBake = readFile(std::string(BAKE_PATH) + "/inc/bake/opencl/bake.cl");
-            std::string clSourceRay = readFile(std::string(BAKE_PATH) + "/inc/bake/opencl/ray.cl");
+            c.qu = cl::CommandQueue(c.ctx, c.d, CL_QUEUE_PROFILING_ENABLE, &err);
+            if (err != CL_SUCCESS) {
+                BAKE_LOG("Failed to create OpenCL upload queue.");
+                return false;
+            }
             
-            cl::Program::Sources sources;
-            sources.push_back(std::make_pair(clSourceRay.c_str(), clSourceRay.size()));
-            sources.push_back(std::make_pair(clSourceBake.c_str(), clSourceBake.size()));
+            c.qr = cl::CommandQueue(c.ctx, c.d, CL_QUEUE_PROFILING_ENABLE, &err);
+            if (err != CL_SUCCESS) {
+                BAKE_LOG("Failed to create OpenCL readback queue.");
+                return false;
+            }
             
+            c.pool.setContext(c.ctx);
+            c.cacheDir = cacheDir;
+            c.variants.clear();
             
-            c.prg = cl::Program(c.ctx, sources, &err);
-            err = c.prg.build(devs);
-            if (err != CL_SUCCESS) {
-                BAKE_LOG("Failed to build OpenCL program: %s", c.prg.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devs.front()).c_str());
+            if (!buildProgram(c, "", c.prg)) {
                 return false;
             }
             
-            c.kBakeTexture = cl::Kernel(c.prg, "bakeTextureMap", &err);
-            if (err != CL_SUCCESS) {
-                BAKE_LOG("Failed to locate kernel");
+            bool ok = createVariantKernels(c.prg, c.generic) &&
+                      createKernel(c.prg, "resolveTexels", c.kResolveTexels) &&
+                      createKernel(c.prg, "dilateTexels", c.kDilateTexels) &&
+                      createKernel(c.prg, "fillInt", c.kFillInt) &&
+                      createKernel(c.prg, "compactTexels", c.kCompactTexels) &&
+                      createKernel(c.prg, "countTileTriangles", c.kCountTileTriangles) &&
+                      createKernel(c.prg, "scanCounts", c.kScanCounts) &&
+                      createKernel(c.prg, "binTileTriangles", c.kBinTileTriangles) &&
+                      createKernel(c.prg, "computeRayKeys", c.kComputeRayKeys) &&
+                      createKernel(c.prg, "radixHistogram", c.kRadixHistogram) &&
+                      createKernel(c.prg, "radixScatter", c.kRadixScatter);
+            if (!ok) {
+                return false;
+            }
+            useVariant(c, c.generic);
+            
+            // Profiles are keyed like the generic program, so they are dropped along with 
+            // binaries when device, driver or kernels change.
+            c.localSizes.clear();
+            if (!cacheDir.empty()) {
+                c.profileKey = programCacheKey(c.d, programSource(), "");
+                if (loadWorkGroupProfile(cacheDir, c.profileKey, c.localSizes)) {
+                    BAKE_LOG("Loaded work-group profile %s.", c.profileKey.c_str());
+                }
+            }
+            
+            for (auto iter = c.localSizes.begin(); iter != c.localSizes.end(); ++iter) {
+                cl::Kernel k;
+                if (iter->second > 0 &&
+                    (!createKernel(c.prg, iter->first.c_str(), k) || k.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(c.d) < (::size_t)iter->second))
+                {
+                    BAKE_LOG("Ignoring profiled work-group size of %s.", iter->first.c_str());
+                    iter->second = 0;
+                }
             }
             
+            // Tile kernels need one work-item per texel of a tile, which register pressure
+            // or device limits might prevent.
+            const ::size_t tileItems = BakeTileSize * BakeTileSize;
+            c.tilesSupported = c.kBakeTiles.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(c.d) >= tileItems;
+            c.scanGroupSize = static_cast<int>(std::min<::size_t>(256, c.kScanCounts.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(c.d)));
+            
+            // Radix histograms need at least one work-item per bucket.
+            const ::size_t radixLimit = std::min(c.kRadixHistogram.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(c.d),
+                                                 c.kRadixScatter.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(c.d));
+            c.radixGroupSize = static_cast<int>(std::min<::size_t>(256, radixLimit));
+            c.sortSupported = c.radixGroupSize >= RadixBuckets;
+            
+            // A few persistent work-groups per compute unit hide memory latency without 
+            // launching more work-items than the device runs concurrently.
+            c.persistentGroupSize = static_cast<int>(std::min<::size_t>(64, c.kBakeTexelsPersistent.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(c.d)));
+            c.persistentGroups = static_cast<int>(c.d.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()) * 4;
+            
             return true;
         }
         
-        bool bakeTextureMap(const Surface &src, const Surface &target) {
-            OCL ocl;
-            if (!initOpenCL(ocl, 2)) {
-                BAKE_LOG("Failed to initialize OpenCL.");
+        /** 
+            Make host data available to the device. 
+         
+            In zero-copy mode the buffer wraps host memory, which therefore must stay alive
+            as long as the buffer is in use. Shared memory runtimes use host memory in place 
+            only when it is page aligned and its size a multiple of 64 bytes, and silently
+            copy it otherwise. Other memory is therefore staged once into a page aligned 
+            copy owned by the buffer. Otherwise a pooled buffer is acquired and a write of 
+            host data into it is enqueued to q. When given, the write event is appended to 
+            events.
+         */
+        bool uploadBuffer(OCL &ocl, const cl::CommandQueue &q, const void *data, ::size_t bytes, cl_mem_flags flags, cl_bool blocking,
+                          PooledBuffer &b, std::vector<cl::Event> *events = 0)
+        {
+            if (ocl.zeroCopy && bytes > 0) {
+                cl_int err;
+                if (isPageAligned(data) && bytes % PagePadding == 0) {
+                    b = PooledBuffer(new cl::Buffer(ocl.ctx, flags | CL_MEM_USE_HOST_PTR, bytes, const_cast<void*>(data), &err));
+                    ASSERT_OPENCL(err, "Failed to create zero-copy buffer.");
+                    return true;
+                }
+                
+                BAKE_LOG("Staging %d bytes of unaligned host memory for zero-copy use.", static_cast<int>(bytes));
+                void *pages = allocatePages(bytes);
+                if (!pages) {
+                    BAKE_LOG("Failed to allocate zero-copy staging memory.");
+                    return false;
+                }
+                memcpy(pages, data, bytes);
+                
+                // Staging memory is released along with the buffer.
+                cl::Buffer *buffer = new cl::Buffer(ocl.ctx, flags | CL_MEM_USE_HOST_PTR, padToPage(bytes), pages, &err);
+                b = PooledBuffer(buffer, [pages](cl::Buffer *p) { delete p; freePages(pages); });
+                ASSERT_OPENCL(err, "Failed to create zero-copy buffer.");
+                return true;
+            }
+            
+            if (!ocl.pool.acquireBuffer(bytes, flags, b)) {
                 return false;
             }
             
-            SurfaceVolume sv;
-            if (!buildSurfaceVolume(src, Eigen::Vector3i::Constant(64), sv)) {
+            if (bytes > 0) {
+                cl::Event e;
+                cl_int err = q.enqueueWriteBuffer(*b, blocking, 0, bytes, data, 0, &e);
+                ASSERT_OPENCL(err, "Failed to write buffer.");
+                if (events) {
+                    events->push_back(e);
+                }
+            }
+            
+            return true;
+        }
+        
+        /** 
+            Bytes of surface matrix storage to upload. Storage is page aligned and padded, so 
+            zero-copy buffers cover the padding and wrap it in place.
+         */
+        template<class M>
+        ::size_t surfaceBytes(const OCL &ocl, const M &m)
+        {
+            const ::size_t bytes = m.size() * sizeof(float);
+            return ocl.zeroCopy ? padToPage(bytes) : bytes;
+        }
+        
+        /** Source surface and its acceleration structure resident on the device. */
+        struct DeviceSource {
+            std::shared_ptr<SurfaceVolume> sv;
+            PooledBuffer bSrcVertexPositions;
+            PooledBuffer bSrcVertexNormals;
+            PooledBuffer bSrcVertexColors;
+            PooledBuffer bSrcVoxels;
+            PooledBuffer bSrcTrianglesInVoxels;
+            bool valid;
+            
+            DeviceSource() : valid(false) {}
+        };
+        
+        /** Grid settings. Zero voxels in any dimension chooses the resolution automatically. */
+        struct GridSettings {
+            GridType type;
+            Eigen::Vector3i voxelsPerDimension;
+            float trianglesPerVoxel;
+            
+            GridSettings() : type(GridUniform), voxelsPerDimension(Eigen::Vector3i::Zero()), trianglesPerVoxel(2.f) {}
+        };
+        
+        /** Density of top-level voxels of two-level grids relative to uniform grids. */
+        const float TwoLevelTopDensity = 16.f;
+        
+        /** Build the surface volume of source. */
+        bool buildSourceVolume(const Surface &src, const GridSettings &grid, std::shared_ptr<SurfaceVolume> &sv)
+        {
+            const bool twoLevel = grid.type == GridTwoLevel;
+            
+            Eigen::Vector3i res = grid.voxelsPerDimension;
+            if ((res.array() <= 0).any()) {
+                const int nTriangles = static_cast<int>(src.vertexPositions.cols() / 3);
+                const float density = twoLevel ? grid.trianglesPerVoxel * TwoLevelTopDensity : grid.trianglesPerVoxel;
+                res = chooseVoxelsPerDimension(computeVolumeBounds(src.vertexPositions), nTriangles, density);
+                BAKE_LOG("Chose grid resolution %dx%dx%d for %d triangles.", res.x(), res.y(), res.z(), nTriangles);
+            }
+            
+            sv = std::make_shared<SurfaceVolume>();
+            const bool ok = twoLevel ? buildTwoLevelSurfaceVolume(src, res, grid.trianglesPerVoxel, *sv) : buildSurfaceVolume(src, res, *sv);
+            if (!ok) {
                 BAKE_LOG("Failed to create surface volume.");
                 return false;
             }
+            return true;
+        }
+        
+        /** Upload source and its volume. The volume is shared, as zero-copy buffers may reference it. */
+        bool uploadSource(OCL &ocl, const Surface &src, const std::shared_ptr<SurfaceVolume> &sv, DeviceSource &ds)
+        {
+            ds = DeviceSource();
+            ds.sv = sv;
             
+            // Source uploads are blocking, so the caller may release source right away
+            // unless zero-copy is active.
             
-            // Target
+            bool ok = uploadBuffer(ocl, ocl.q, src.vertexPositions.data(), surfaceBytes(ocl, src.vertexPositions),
+                                   CL_MEM_READ_ONLY, CL_TRUE, ds.bSrcVertexPositions);
+            ok = ok && uploadBuffer(ocl, ocl.q, src.vertexNormals.data(), surfaceBytes(ocl, src.vertexNormals),
+                                    CL_MEM_READ_ONLY, CL_TRUE, ds.bSrcVertexNormals);
+            ok = ok && uploadBuffer(ocl, ocl.q, src.vertexColors.data(), surfaceBytes(ocl, src.vertexColors),
+                                    CL_MEM_READ_ONLY, CL_TRUE, ds.bSrcVertexColors);
             
-            cl_int err;
+            // Volume
+            
+            // Volume storage is page aligned and padded, so zero-copy buffers may cover the
+            // padding and wrap it in place.
             
-            cl::Buffer bTargetVertexPositions(ocl.ctx,
-                                              CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                              target.vertexPositions.array().size() * sizeof(float),
-                                              const_cast<float*>(target.vertexPositions.data()),
-                                              &err);
-            ASSERT_OPENCL(err, "Failed to create vertex buffer for target.");
+            const ::size_t cellBytes = ocl.zeroCopy ? padToPage(sv->cells.size() * sizeof(int)) : sv->cells.size() * sizeof(int);
+            const ::size_t indexBytes = ocl.zeroCopy ? padToPage(sv->triangleIndices.size() * sizeof(int)) : sv->triangleIndices.size() * sizeof(int);
             
+            ok = ok && uploadBuffer(ocl, ocl.q, sv->cells.data(), cellBytes,
+                                    CL_MEM_READ_ONLY, CL_TRUE, ds.bSrcVoxels);
+            ok = ok && uploadBuffer(ocl, ocl.q, sv->triangleIndices.data(), indexBytes,
+                                    CL_MEM_READ_ONLY, CL_TRUE, ds.bSrcTrianglesInVoxels);
+            
+            if (!ok) {
+                BAKE_LOG("Failed to upload source.");
+                return false;
+            }
             
-            cl::Buffer bTargetVertexUVs(ocl.ctx,
-                                        CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                        target.vertexUVs.array().size() * sizeof(float),
-                                        const_cast<float*>(target.vertexUVs.data()), &err);
-            ASSERT_OPENCL(err, "Failed to create UV buffer for target.");
+            ds.valid = true;
+            return true;
+        }
+        
+        /** Decide whether host memory is used in place. */
+        void configureHostMemory(OCL &ocl, HostMemoryMode mode)
+        {
+            switch (mode) {
+                case HostMemoryAuto:
+                    ocl.zeroCopy = ocl.d.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE;
+                    break;
+                case HostMemoryCopy:
+                    ocl.zeroCopy = false;
+                    break;
+                case HostMemoryZeroCopy:
+                    ocl.zeroCopy = true;
+                    break;
+            }
             
-            cl::Buffer bTargetVertexNormals(ocl.ctx,
-                                            CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                            target.vertexNormals.array().size() * sizeof(float),
-                                            const_cast<float*>(target.vertexNormals.data()), &err);
-            ASSERT_OPENCL(err, "Failed to create normals buffer for target.");
+            if (ocl.zeroCopy) {
+                BAKE_LOG("Using zero-copy host memory on %s.", ocl.d.getInfo<CL_DEVICE_NAME>().c_str());
+            }
+        }
+        
+        struct Baker::Data {
+            OCL ocl;
+            DeviceSource source;
+            bool initialized;
+            std::string programCacheDir;
+            HostMemoryMode hostMemoryMode;
+            GridSettings grid;
             
-            // Source
+            Data() : initialized(false), hostMemoryMode(HostMemoryAuto) {}
+        };
+        
+        Baker::Baker()
+        : _data(new Data())
+        {}
+        
+        Baker::~Baker()
+        {}
+        
+        bool Baker::init(int deviceId)
+        {
+            _data->source = DeviceSource();
+            _data->initialized = initOpenCL(_data->ocl, deviceId, _data->programCacheDir);
+            if (!_data->initialized) {
+                return false;
+            }
             
-            cl::Buffer bSrcVertexPositions(ocl.ctx,
-                                           CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                           src.vertexPositions.array().size() * sizeof(float),
-                                           const_cast<float*>(src.vertexPositions.data()),
-                                           &err);
-            ASSERT_OPENCL(err, "Failed to create vertex buffer for source.");
+            configureHostMemory(_data->ocl, _data->hostMemoryMode);
+            return true;
+        }
+        
+        void Baker::setHostMemoryMode(HostMemoryMode mode)
+        {
+            _data->hostMemoryMode = mode;
+        }
+        
+        void Baker::setProgramCacheDirectory(const std::string &dir)
+        {
+            _data->programCacheDir = dir;
+        }
+        
+        void Baker::setKernelSpecialization(bool enable)
+        {
+            _data->ocl.specialize = enable;
+        }
+        
+        void Baker::setGridResolution(const Eigen::Vector3i &voxelsPerDimension)
+        {
+            _data->grid.voxelsPerDimension = voxelsPerDimension;
+        }
+        
+        void Baker::setGridDensity(float trianglesPerVoxel)
+        {
+            _data->grid.trianglesPerVoxel = trianglesPerVoxel;
+        }
+        
+        void Baker::setGridType(GridType type)
+        {
+            _data->grid.type = type;
+        }
+        
+        bool Baker::init(DevicePolicy policy)
+        {
+            const int deviceId = selectDevice(listDevices(), policy);
+            if (deviceId < 0) {
+                BAKE_LOG("No suitable OpenCL device found.");
+                return false;
+            }
+            return init(deviceId);
+        }
+        
+        bool Baker::isInitialized() const
+        {
+            return _data->initialized;
+        }
+        
+        bool Baker::setSource(const Surface &src)
+        {
+            if (!_data->initialized) {
+                BAKE_LOG("Baker is not initialized.");
+                return false;
+            }
             
-            cl::Buffer bSrcVertexNormals(ocl.ctx,
-                                         CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                         src.vertexNormals.array().size() * sizeof(float),
-                                         const_cast<float*>(src.vertexNormals.data()), &err);
-            ASSERT_OPENCL(err, "Failed to create normals buffer for source.");
+            std::shared_ptr<SurfaceVolume> sv;
+            if (!buildSourceVolume(src, _data->grid, sv)) {
+                return false;
+            }
             
+            return uploadSource(_data->ocl, src, sv, _data->source);
+        }
+        
+        struct BakeTask::State {
+            /** Device memory referenced by the enqueued commands. Handed over to the completion handler. */
+            std::vector<PooledBuffer> buffers;
+            std::vector<PooledImage> images;
+            /** Source volume, which zero-copy source buffers reference in place. */
+            std::shared_ptr<SurfaceVolume> volume;
+            /** Target upload events, only writes and copies. */
+            std::vector<cl::Event> uploads;
+            /** Clearing kernels enqueued along with target uploads. */
+            std::vector<cl::Event> clears;
+            /** Bake kernel events in order of execution. */
+            std::vector<cl::Event> kernels;
+            /** Signaled when texture readback completed. */
+            cl::Event done;
+        };
+        
+        BakeTask::BakeTask()
+        {}
+        
+        bool BakeTask::valid() const
+        {
+            return (bool)_state;
+        }
+        
+        bool BakeTask::ready() const
+        {
+            if (!_state) {
+                return true;
+            }
             
-            cl::Buffer bSrcVertexColors(ocl.ctx,
-                                        CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                        src.vertexColors.array().size() * sizeof(float),
-                                        const_cast<float*>(src.vertexColors.data()), &err);
-            ASSERT_OPENCL(err, "Failed to create color buffer for source.");
+            cl_int status = _state->done.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+            return status == CL_COMPLETE || status < 0;
+        }
+        
+        bool BakeTask::wait()
+        {
+            if (!_state) {
+                return false;
+            }
             
-            // Volume
+            cl_int err = _state->done.wait();
+            ASSERT_OPENCL(err, "Failed to wait for bake.");
             
-            cl::Buffer bSrcVoxels(ocl.ctx,
-                                  CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                  (int)sv.cells.size() * sizeof(int),
-                                  const_cast<int*>(sv.cells.data()),
-                                  &err);
-            ASSERT_OPENCL(err, "Failed to create voxel buffer for source.");
+            cl_int status = _state->done.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+            ASSERT_OPENCL(status == CL_COMPLETE ? CL_SUCCESS : status, "Bake failed on device.");
             
-            cl::Buffer bSrcTrianglesInVoxels(ocl.ctx,
-                                             CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                             (int)sv.triangleIndices.size() * sizeof(int),
-                                             const_cast<int*>(sv.triangleIndices.data()),
-                                             &err);
-            ASSERT_OPENCL(err, "Failed to triangle index buffer for source.");
+            return true;
+        }
+        
+        /** 
+            Resources of a bake released once the device is done with it. 
+         
+            Uploads and kernels run on different queues, so pooled memory must not be
+            reused before the whole bake completed.
+         */
+        struct BakeCompletion {
+            std::vector<PooledBuffer> buffers;
+            std::vector<PooledImage> images;
+            std::shared_ptr<SurfaceVolume> volume;
+            BakeCallback callback;
+        };
+        
+        /** Invoked from the OpenCL runtime once readback finished. */
+        void CL_CALLBACK onBakeCompleted(cl_event, cl_int status, void *userData)
+        {
+            BakeCompletion *c = static_cast<BakeCompletion*>(userData);
+            if (c->callback) {
+                c->callback(status == CL_COMPLETE);
+            }
+            delete c;
+        }
+        
+        /** Test bake parameters for values the kernels cannot handle. */
+        bool validParameters(const BakeParameters &params)
+        {
+            const int s = params.samplesPerAxis;
+            if (s < 1 || s > 16 || (s & (s - 1)) != 0) {
+                BAKE_LOG("Samples per axis need to be a power of two between 1 and 16.");
+                return false;
+            }
+            if (params.dilation < 0) {
+                BAKE_LOG("Dilation needs to be zero or positive.");
+                return false;
+            }
+            return true;
+        }
+        
+        /** Target geometry and output texture resident on the device. */
+        struct DeviceTarget {
+            PooledBuffer bTargetVertexPositions;
+            PooledBuffer bTargetVertexUVs;
+            PooledBuffer bTargetVertexNormals;
+            PooledImage bTexture;
+            /** Dilation only: ping-pong texture of edge padding. */
+            PooledImage bTextureAlt;
+            /** Dilation only: texels written by the bake and ping-pong mask of edge padding, one byte per texel. */
+            PooledBuffer bCoverage;
+            PooledBuffer bCoverageAlt;
+            /** Multi-sampled per-triangle dispatch only: fixed-point color sums and sample counts per texel. */
+            PooledBuffer bAccumulation;
+            /** Per-texel dispatch only: texel to target triangle map, -1 for uncovered texels. */
+            PooledBuffer bTexelTriangles;
+            /** Per-texel dispatch only: barycentrics of texel centers. */
+            PooledBuffer bTexelBarycentrics;
+            /** Per-texel dispatch only: compact list of texels to bake and its length. */
+            PooledBuffer bTexels;
+            PooledBuffer bTexelCount;
+            /** Persistent dispatch only: next list entry to hand out. */
+            PooledBuffer bNextTexel;
+            /** Ray sorting only: keys, ping-pong buffers for keys and texels and radix histograms. */
+            PooledBuffer bRayKeys;
+            PooledBuffer bRayKeysAlt;
+            PooledBuffer bTexelsAlt;
+            PooledBuffer bRadixCounts;
+            PooledBuffer bRadixOffsets;
+            PooledBuffer bRadixCursors;
+            /** Wavefront dispatch only: rays and hit records of one wave. */
+            PooledBuffer bRayOrigins;
+            PooledBuffer bRayDirections;
+            PooledBuffer bHits;
+            int waveRays;
+            /** Tiled dispatch only: triangles per tile, list offsets and ends and the concatenated lists. */
+            PooledBuffer bTileCounts;
+            PooledBuffer bTileOffsets;
+            PooledBuffer bTileEnds;
+            PooledBuffer bTileTriangles;
+            int tileCapacity;
+            int tilesPerRow;
+            /** Dispatch in effect, which may differ from the requested one when unsupported by the device. */
+            BakeDispatch dispatch;
+            /** Sort texel rays before tracing. */
+            bool sortRays;
+            /** Samples are accumulated and need to be resolved into the texture after baking. */
+            bool accumulate;
+            /** Signaled when uploads to the upload queue completed. */
+            std::vector<cl::Event> uploaded;
+            /** Writes and copies among uploaded. */
+            std::vector<cl::Event> writes;
+            /** Clearing kernels among uploaded. */
+            std::vector<cl::Event> clears;
+            int imageSize;
+            int nTriangles;
             
-            float minmax[8] = {
-                sv.bounds.min().x(), sv.bounds.min().y(), sv.bounds.min().z(), 0.f,
-                sv.bounds.max().x(), sv.bounds.max().y(), sv.bounds.max().z(), 0.f,
+            DeviceTarget() : waveRays(0), tileCapacity(0), tilesPerRow(0), dispatch(DispatchPerTriangle), sortRays(false), accumulate(false), imageSize(0), nTriangles(0) {}
+        };
+        
+        /** Append all device memory of target to buffers. */
+        void appendBuffers(const DeviceTarget &dt, std::vector<PooledBuffer> &buffers)
+        {
+            const PooledBuffer *all[] = {
+                &dt.bTargetVertexPositions, &dt.bTargetVertexUVs, &dt.bTargetVertexNormals, &dt.bAccumulation,
+                &dt.bCoverage, &dt.bCoverageAlt,
+                &dt.bTexelTriangles, &dt.bTexelBarycentrics, &dt.bTexels, &dt.bTexelCount, &dt.bNextTexel,
+                &dt.bRayKeys, &dt.bRayKeysAlt, &dt.bTexelsAlt, &dt.bRadixCounts, &dt.bRadixOffsets, &dt.bRadixCursors,
+                &dt.bRayOrigins, &dt.bRayDirections, &dt.bHits,
+                &dt.bTileCounts, &dt.bTileOffsets, &dt.bTileEnds, &dt.bTileTriangles
             };
             
-            cl_float4 voxelSizes = {{sv.voxelSizes.x(), sv.voxelSizes.y(), sv.voxelSizes.z(), 0}};
-            cl_float4 invVoxelSizes = {{1.f / sv.voxelSizes.x(), 1.f / sv.voxelSizes.y(), 1.f / sv.voxelSizes.z(), 0}};
-            cl_int4 voxelsPerDim = {{sv.voxelsPerDimension.x(), sv.voxelsPerDimension.y(), sv.voxelsPerDimension.z(), 0}};
+            for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); ++i) {
+                if (*all[i]) {
+                    buffers.push_back(*all[i]);
+                }
+            }
+        }
+        
+        /** Append all images of target to images. */
+        void appendImages(const DeviceTarget &dt, std::vector<PooledImage> &images)
+        {
+            images.push_back(dt.bTexture);
+            if (dt.bTextureAlt) {
+                images.push_back(dt.bTextureAlt);
+            }
+        }
+        
+        /** Kernel argument of an optional buffer, which kernels see as a null pointer when absent. */
+        cl::Buffer optionalArg(const PooledBuffer &b)
+        {
+            return b ? *b : cl::Buffer();
+        }
+        
+        /** Local work size of kernel from the work-group profile. Zero leaves the choice to the driver. */
+        int localSize(const OCL &ocl, const char *kernel)
+        {
+            auto iter = ocl.localSizes.find(kernel);
+            return (iter != ocl.localSizes.end()) ? iter->second : 0;
+        }
+        
+        /** Local range of kernel from the work-group profile. */
+        cl::NDRange localRange(const OCL &ocl, const char *kernel)
+        {
+            const int local = localSize(ocl, kernel);
+            return (local > 0) ? cl::NDRange(local) : cl::NullRange;
+        }
+        
+        /** 
+            Global range of n work-items padded to a multiple of the profiled local size of 
+            kernel. Kernels discard surplus work-items.
+         */
+        cl::NDRange globalRange(const OCL &ocl, const char *kernel, int n)
+        {
+            const int local = localSize(ocl, kernel);
+            return cl::NDRange((local > 0) ? ((n + local - 1) / local) * local : n);
+        }
+        
+        /** Enqueue filling of n integers of buffer with value. */
+        bool enqueueFillInt(OCL &ocl, const cl::CommandQueue &q, const cl::Buffer &b, int value, int n, cl::Event *e)
+        {
+            ocl.kFillInt.setArg(0, b);
+            ocl.kFillInt.setArg(1, value);
+            ocl.kFillInt.setArg(2, n);
+            
+            cl_int err = q.enqueueNDRangeKernel(ocl.kFillInt, cl::NullRange, cl::NDRange(n), cl::NullRange, 0, e);
+            ASSERT_OPENCL(err, "Failed to fill buffer.");
             
-            // Texture
+            return true;
+        }
+        
+        /** Acquire texel map and texel list of texel dispatch modes and enqueue clearing of the map. */
+        bool prepareTexelMap(OCL &ocl, const BakeParameters &params, DeviceTarget &dt)
+        {
+            const int nTexels = dt.imageSize * dt.imageSize;
+            
+            bool ok = ocl.pool.acquireBuffer(nTexels * sizeof(cl_int), CL_MEM_READ_WRITE, dt.bTexelTriangles);
+            ok = ok && ocl.pool.acquireBuffer(nTexels * sizeof(cl_float2), CL_MEM_READ_WRITE, dt.bTexelBarycentrics);
+            ok = ok && ocl.pool.acquireBuffer(nTexels * sizeof(cl_int), CL_MEM_READ_WRITE, dt.bTexels);
+            ok = ok && ocl.pool.acquireBuffer(sizeof(cl_int), CL_MEM_READ_WRITE, dt.bTexelCount);
+            if (dt.dispatch == DispatchPersistent) {
+                ok = ok && ocl.pool.acquireBuffer(sizeof(cl_int), CL_MEM_READ_WRITE, dt.bNextTexel);
+            }
+            if (dt.dispatch == DispatchWavefront) {
+                const int samplesPerTexel = params.samplesPerAxis * params.samplesPerAxis;
+                dt.waveRays = std::min(WavefrontRays, nTexels * samplesPerTexel);
+                ok = ok && ocl.pool.acquireBuffer(dt.waveRays * sizeof(cl_float4), CL_MEM_READ_WRITE, dt.bRayOrigins);
+                ok = ok && ocl.pool.acquireBuffer(dt.waveRays * sizeof(cl_float4), CL_MEM_READ_WRITE, dt.bRayDirections);
+                ok = ok && ocl.pool.acquireBuffer(dt.waveRays * sizeof(cl_int4), CL_MEM_READ_WRITE, dt.bHits);
+            }
+            if (dt.sortRays) {
+                const int nBlocks = (nTexels + ocl.radixGroupSize - 1) / ocl.radixGroupSize;
+                ok = ok && ocl.pool.acquireBuffer(nTexels * sizeof(cl_uint), CL_MEM_READ_WRITE, dt.bRayKeys);
+                ok = ok && ocl.pool.acquireBuffer(nTexels * sizeof(cl_uint), CL_MEM_READ_WRITE, dt.bRayKeysAlt);
+                ok = ok && ocl.pool.acquireBuffer(nTexels * sizeof(cl_int), CL_MEM_READ_WRITE, dt.bTexelsAlt);
+                ok = ok && ocl.pool.acquireBuffer(nBlocks * RadixBuckets * sizeof(cl_int), CL_MEM_READ_WRITE, dt.bRadixCounts);
+                ok = ok && ocl.pool.acquireBuffer(nBlocks * RadixBuckets * sizeof(cl_int), CL_MEM_READ_WRITE, dt.bRadixOffsets);
+                ok = ok && ocl.pool.acquireBuffer(nBlocks * RadixBuckets * sizeof(cl_int), CL_MEM_READ_WRITE, dt.bRadixCursors);
+            }
+            if (!ok) {
+                BAKE_LOG("Failed to create texel map.");
+                return false;
+            }
             
-            const int imagesize = 512;
+            cl::Event e;
+            if (!enqueueFillInt(ocl, ocl.qu, *dt.bTexelTriangles, -1, nTexels, &e)) {
+                return false;
+            }
+            dt.uploaded.push_back(e);
+            dt.clears.push_back(e);
             
-            Image<unsigned char> texture(imagesize, imagesize, 3);
-            texture.toOpenCV().setTo(0);
+            return true;
+        }
+        
+        /** 
+            Count triangle / tile pairs of target. Bounding boxes are grown by a texel, so
+            the count is an upper bound of the pairs binned on the device. Like on the device,
+            triangles with coordinates that are not finite in texel units are skipped.
+         */
+        int countTilePairs(const Surface &target, int imageSize)
+        {
+            const int nTriangles = static_cast<int>(target.vertexUVs.cols() / 3);
+            const int maxTile = (imageSize - 1) / BakeTileSize;
             
-            cl::Image2D bTexture(ocl.ctx,
-                                 CL_MEM_WRITE_ONLY | CL_MEM_COPY_HOST_PTR,
-                                 cl::ImageFormat(CL_RGB, CL_UNORM_INT8),
-                                 imagesize, imagesize, 0, texture.row(0), &err);
-            ASSERT_OPENCL(err, "Failed to create texture image.");
-            
-            int argc = 0;
-            ocl.kBakeTexture.setArg(0, bTargetVertexPositions);
-            ocl.kBakeTexture.setArg(1, bTargetVertexNormals);
-            ocl.kBakeTexture.setArg(2, bTargetVertexUVs);
-            ocl.kBakeTexture.setArg(3, bSrcVertexPositions);
-            ocl.kBakeTexture.setArg(4, bSrcVertexNormals);
-            ocl.kBakeTexture.setArg(5, bSrcVertexColors);
-            ocl.kBakeTexture.setArg(6, bSrcVoxels);
-            ocl.kBakeTexture.setArg(7, bSrcTrianglesInVoxels);
-            ocl.kBakeTexture.setArg(8, carray(minmax, 8));
-            ocl.kBakeTexture.setArg(9, sizeof(cl_float4), voxelSizes.s);
-            ocl.kBakeTexture.setArg(10, sizeof(cl_float4), invVoxelSizes.s);
-            ocl.kBakeTexture.setArg(11, sizeof(cl_int4), voxelsPerDim.s);
-            ocl.kBakeTexture.setArg(12, bTexture);
-            ocl.kBakeTexture.setArg(13, imagesize);
-            ocl.kBakeTexture.setArg(14, 0.5f);
-            ocl.kBakeTexture.setArg(15, (int)target.vertexPositions.cols()/3);
-            
-            int nTrianglesDivisableBy2 = target.vertexPositions.cols()/3 + (target.vertexPositions.cols()/3) % 2;
-            
-            err = ocl.q.enqueueNDRangeKernel(ocl.kBakeTexture, cl::NullRange, cl::NDRange(nTrianglesDivisableBy2), cl::NullRange);
-            ASSERT_OPENCL(err, "Failed to run bake kernel.");
+            int pairs = 0;
+            for (int t = 0; t < nTriangles; ++t) {
+                if (!(target.vertexUVs.middleCols(t*3, 3) * float(imageSize)).allFinite()) {
+                    continue;
+                }
+                
+                Eigen::Vector2f uvMin = target.vertexUVs.col(t*3+0);
+                Eigen::Vector2f uvMax = uvMin;
+                uvMin = uvMin.cwiseMin(target.vertexUVs.col(t*3+1)).cwiseMin(target.vertexUVs.col(t*3+2));
+                uvMax = uvMax.cwiseMax(target.vertexUVs.col(t*3+1)).cwiseMax(target.vertexUVs.col(t*3+2));
+                
+                int tMin[2], tMax[2];
+                bool empty = false;
+                for (int i = 0; i < 2; ++i) {
+                    float lo = std::max(uvMin[i] * imageSize - 1.5f, 0.f);
+                    float hi = std::min(uvMax[i] * imageSize + 0.5f, float(imageSize - 1));
+                    // Also rejects NaN coordinates.
+                    if (!(lo <= hi)) {
+                        empty = true;
+                        break;
+                    }
+                    tMin[i] = std::min(static_cast<int>(lo) / BakeTileSize, maxTile);
+                    tMax[i] = std::min(static_cast<int>(hi) / BakeTileSize, maxTile);
+                }
+                
+                if (!empty) {
+                    pairs += (tMax[0] - tMin[0] + 1) * (tMax[1] - tMin[1] + 1);
+                }
+            }
+            
+            return pairs;
+        }
+        
+        /** Acquire tile bins of tiled dispatch. Bins are filled per triangle range when baking. */
+        bool prepareTiles(OCL &ocl, const Surface &target, DeviceTarget &dt)
+        {
+            dt.tilesPerRow = (dt.imageSize + BakeTileSize - 1) / BakeTileSize;
+            dt.tileCapacity = countTilePairs(target, dt.imageSize);
+            const int nTiles = dt.tilesPerRow * dt.tilesPerRow;
             
-            cl::size_t<3> origin;
+            bool ok = ocl.pool.acquireBuffer(nTiles * sizeof(cl_int), CL_MEM_READ_WRITE, dt.bTileCounts);
+            ok = ok && ocl.pool.acquireBuffer(nTiles * sizeof(cl_int), CL_MEM_READ_WRITE, dt.bTileOffsets);
+            ok = ok && ocl.pool.acquireBuffer(nTiles * sizeof(cl_int), CL_MEM_READ_WRITE, dt.bTileEnds);
+            ok = ok && ocl.pool.acquireBuffer(std::max(dt.tileCapacity, 1) * sizeof(cl_int), CL_MEM_READ_WRITE, dt.bTileTriangles);
+            if (!ok) {
+                BAKE_LOG("Failed to create tile bins.");
+                return false;
+            }
+            
+            return true;
+        }
+        
+        /** Return origin and region covering a whole square image. */
+        void imageRegion(int imageSize, cl::size_t<3> &origin, cl::size_t<3> &region)
+        {
             origin.push_back(0);
             origin.push_back(0);
             origin.push_back(0);
             
-            cl::size_t<3> region;
-            region.push_back(imagesize);
-            region.push_back(imagesize);
+            region.push_back(imageSize);
+            region.push_back(imageSize);
             region.push_back(1);
+        }
+        
+        /** Test if dispatch bakes from a texel map of covering triangles rather than from triangles. */
+        bool usesTexelMap(BakeDispatch dispatch)
+        {
+            return dispatch == DispatchPerTexel || dispatch == DispatchPersistent || dispatch == DispatchWavefront;
+        }
+        
+        /** 
+            Enqueue target upload and clearing of the device texture on the upload queue. Clears the host texture as well.
+            A coverage mask is kept when edge padding is requested or coverage is set.
+         */
+        bool uploadTarget(OCL &ocl, const Surface &target, Image<unsigned char> &texture, const BakeParameters &params, DeviceTarget &dt,
+                          bool coverage = false)
+        {
+            dt = DeviceTarget();
+            dt.imageSize = texture.rows();
+            dt.nTriangles = static_cast<int>(target.vertexPositions.cols() / 3);
             
-            err = ocl.q.enqueueReadImage(bTexture, false, origin, region, 0, 0, texture.row(0));
-            ASSERT_OPENCL(err, "Failed to read image.");
-            ocl.q.finish();
+            bool ok = uploadBuffer(ocl, ocl.qu, target.vertexPositions.data(), surfaceBytes(ocl, target.vertexPositions),
+                                   CL_MEM_READ_ONLY, CL_FALSE, dt.bTargetVertexPositions, &dt.uploaded);
+            ok = ok && uploadBuffer(ocl, ocl.qu, target.vertexUVs.data(), surfaceBytes(ocl, target.vertexUVs),
+                                    CL_MEM_READ_ONLY, CL_FALSE, dt.bTargetVertexUVs, &dt.uploaded);
+            ok = ok && uploadBuffer(ocl, ocl.qu, target.vertexNormals.data(), surfaceBytes(ocl, target.vertexNormals),
+                                    CL_MEM_READ_ONLY, CL_FALSE, dt.bTargetVertexNormals, &dt.uploaded);
             
-            cv::Mat m = texture.toOpenCV();
-            cv::flip(m, m, 0);
+            if (!ok) {
+                BAKE_LOG("Failed to upload target.");
+                return false;
+            }
+            dt.writes = dt.uploaded;
             
-            cv::imwrite("input.png", m);
-            cv::imshow("test", m);
-            cv::waitKey();
+            texture.toOpenCV().setTo(0);
             
+            // Edge padding reads back the texture in a later kernel.
+            const cl_mem_flags textureFlags = (params.dilation > 0) ? CL_MEM_READ_WRITE : CL_MEM_WRITE_ONLY;
+            if (!ocl.pool.acquireImage(dt.imageSize, dt.imageSize, cl::ImageFormat(CL_RGB, CL_UNORM_INT8), textureFlags, dt.bTexture)) {
+                BAKE_LOG("Failed to create texture image.");
+                return false;
+            }
             
-            return false;
-        }
-        
-    }
-}
\ No newline at end of file
+            cl::size_t<3> origin, region;
+            imageRegion(dt.imageSize, origin, region);
+            
+            // Pooled images carry content of previous bakes, so clear explicitly.
+            cl::Event e;
+            cl_int err = ocl.qu.enqueueWriteImage(*dt.bTexture, false, origin, region, 0, 0, texture.row(0), 0, &e);
+            ASSERT_OPENCL(err, "Failed to clear texture image.");
+            dt.uploaded.push_back(e);
+            dt.writes.push_back(e);
+            
+            dt.dispatch = params.dispatch;
+            if (dt.dispatch == DispatchTiled && !ocl.tilesSupported) {
+                BAKE_LOG("Device does not support tiled dispatch, falling back to per-texel dispatch.");
+                dt.dispatch = DispatchPerTexel;
+            }
+            
+            const bool texelMap = usesTexelMap(dt.dispatch);
+            dt.sortRays = texelMap && params.sortRays;
+            if (dt.sortRays && !ocl.sortSupported) {
+                BAKE_LOG("Device does not support ray sorting, tracing unsorted.");
+                dt.sortRays = false;
+            }
+            
+            if (texelMap && !prepareTexelMap(ocl, params, dt)) {
+                return false;
+            }
+            
+            if (dt.dispatch == DispatchTiled && !prepareTiles(ocl, target, dt)) {
+                return false;
+            }
+            
+            // Only per-triangle dispatch spreads the samples of a texel over work-items.
+            dt.accumulate = dt.dispatch == DispatchPerTriangle && params.samplesPerAxis > 1;
+            if (dt.accumulate) {
+                const int nValues = dt.imageSize * dt.imageSize * 4;
+                if (!ocl.pool.acquireBuffer(nValues * sizeof(cl_uint), CL_MEM_READ_WRITE, dt.bAccumulation)) {
+                    BAKE_LOG("Failed to create accumulation buffer.");
+                    return false;
+                }
+                
+                cl::Event e;
+                if (!enqueueFillInt(ocl, ocl.qu, *dt.bAccumulation, 0, nValues, &e)) {
+                    return false;
+                }
+                dt.uploaded.push_back(e);
+                dt.clears.push_back(e);
+            }
+            
+            if (params.dilation > 0 || coverage) {
+                // Coverage is filled as integers, so round up to whole integers.
+                const int nWords = (dt.imageSize * dt.imageSize + 3) / 4;
+                if (!ocl.pool.acquireBuffer(nWords * sizeof(cl_int), CL_MEM_READ_WRITE, dt.bCoverage)) {
+                    BAKE_LOG("Failed to create coverage mask.");
+                    return false;
+                }
+                
+                cl::Event e;
+                if (!enqueueFillInt(ocl, ocl.qu, *dt.bCoverage, 0, nWords, &e)) {
+                    return false;
+                }
+                dt.uploaded.push_back(e);
+                dt.clears.push_back(e);
+            }
+            
+            err = ocl.qu.flush();
+            ASSERT_OPENCL(err, "Failed to submit target upload.");
+            
+            return true;
+        }
+        
+        /** Build options defining the launch constants of a bake, see bake.cl. */
+        std::string variantOptions(const DeviceSource &ds, const DeviceTarget &dt, const BakeParameters &params)
+        {
+            const Eigen::Vector3i &voxels = ds.sv->voxelsPerDimension;
+            
+            std::ostringstream o;
+            o << "-D BAKE_IMAGE_SIZE=" << dt.imageSize
+              << " -D BAKE_SAMPLES=" << params.samplesPerAxis
+              << " -D BAKE_VOXELS_X=" << voxels.x()
+              << " -D BAKE_VOXELS_Y=" << voxels.y()
+              << " -D BAKE_VOXELS_Z=" << voxels.z();
+            
+            // Hexadecimal floating point literals represent stepOut exactly.
+            if (std::isfinite(params.stepOut)) {
+                char stepOut[64];
+                snprintf(stepOut, sizeof(stepOut), "%af", params.stepOut);
+                o << " -D BAKE_STEP_OUT=" << stepOut;
+            }
+            
+            return o.str();
+        }
+        
+        /** 
+            Build a program variant and check that it runs the launch configuration derived 
+            from the generic kernels, including tuned local sizes.
+         */
+        bool buildVariant(OCL &ocl, const std::string &options, KernelVariant &v)
+        {
+            cl::Program prg;
+            if (!buildProgram(ocl, options, prg) || !createVariantKernels(prg, v)) {
+                return false;
+            }
+            
+            const ::size_t tileItems = BakeTileSize * BakeTileSize;
+            if ((ocl.tilesSupported && v.kBakeTiles.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(ocl.d) < tileItems) ||
+                v.kBakeTexelsPersistent.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(ocl.d) < (::size_t)ocl.persistentGroupSize)
+            {
+                BAKE_LOG("Kernel variant does not support the work-group sizes of the generic kernels.");
+                return false;
+            }
+            
+            // Tuned local sizes were checked against the generic program only, while variants
+            // may need more registers per work-item.
+            for (auto iter = ocl.localSizes.begin(); iter != ocl.localSizes.end(); ++iter) {
+                cl::Kernel k;
+                if (iter->second > 0 &&
+                    (!createKernel(prg, iter->first.c_str(), k) || k.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(ocl.d) < (::size_t)iter->second))
+                {
+                    BAKE_LOG("Kernel variant does not support the tuned work-group size of %s.", iter->first.c_str());
+                    return false;
+                }
+            }
+            
+            return true;
+        }
+        
+        /** 
+            Select the kernels used for a bake. With specialization enabled, these are the 
+            kernels of the variant matching the launch constants of the bake, which is built 
+            once on first use. Falls back to the generic kernels when a variant fails to build.
+         */
+        void selectKernels(OCL &ocl, const DeviceSource &ds, const DeviceTarget &dt, const BakeParameters &params)
+        {
+            if (!ocl.specialize) {
+                useVariant(ocl, ocl.generic);
+                return;
+            }
+            
+            const std::string options = variantOptions(ds, dt, params);
+            auto iter = ocl.variants.find(options);
+            if (iter == ocl.variants.end()) {
+                KernelVariant v;
+                if (!buildVariant(ocl, options, v)) {
+                    BAKE_LOG("Failed to build kernel variant %s, using generic kernels.", options.c_str());
+                    v = ocl.generic;
+                }
+                // Failed variants are stored as well, so they are not rebuilt for every bake.
+                iter = ocl.variants.insert(std::make_pair(options, v)).first;
+            }
+            
+            useVariant(ocl, iter->second);
+        }
+        
+        /** 
+            Set source arguments, which all bake kernels expect as one block starting at 
+            index first. Returns the index following the block.
+         */
+        int setSourceArgs(cl::Kernel &k, int first, const DeviceSource &ds)
+        {
+            const SurfaceVolume &sv = *ds.sv;
+            
+            float minmax[8] = {
+                sv.bounds.min().x(), sv.bounds.min().y(), sv.bounds.min().z(), 0.f,
+                sv.bounds.max().x(), sv.bounds.max().y(), sv.bounds.max().z(), 0.f,
+            };
+            
+            cl_float4 voxelSizes = {{sv.voxelSizes.x(), sv.voxelSizes.y(), sv.voxelSizes.z(), 0}};
+            cl_float4 invVoxelSizes = {{1.f / sv.voxelSizes.x(), 1.f / sv.voxelSizes.y(), 1.f / sv.voxelSizes.z(), 0}};
+            cl_int4 voxelsPerDim = {{sv.voxelsPerDimension.x(), sv.voxelsPerDimension.y(), sv.voxelsPerDimension.z(), 0}};
+            
+            k.setArg(first + 0, *ds.bSrcVertexPositions);
+            k.setArg(first + 1, *ds.bSrcVertexNormals);
+            k.setArg(first + 2, *ds.bSrcVertexColors);
+            k.setArg(first + 3, *ds.bSrcVoxels);
+            k.setArg(first + 4, *ds.bSrcTrianglesInVoxels);
+            k.setArg(first + 5, carray(minmax, 8));
+            k.setArg(first + 6, sizeof(cl_float4), voxelSizes.s);
+            k.setArg(first + 7, sizeof(cl_float4), invVoxelSizes.s);
+            k.setArg(first + 8, sizeof(cl_int4), voxelsPerDim.s);
+            
+            return first + 9;
+        }
+        
+        /** Enqueue one work-item per target triangle in [begin, end). */
+        bool enqueuePerTriangle(OCL &ocl, const DeviceSource &ds, const DeviceTarget &dt, const BakeParameters &params,
+                                int begin, int end, std::vector<cl::Event> &kernels)
+        {
+            ocl.kBakeTexture.setArg(0, *dt.bTargetVertexPositions);
+            ocl.kBakeTexture.setArg(1, *dt.bTargetVertexNormals);
+            ocl.kBakeTexture.setArg(2, *dt.bTargetVertexUVs);
+            int arg = setSourceArgs(ocl.kBakeTexture, 3, ds);
+            ocl.kBakeTexture.setArg(arg++, *dt.bTexture);
+            ocl.kBakeTexture.setArg(arg++, optionalArg(dt.bCoverage));
+            ocl.kBakeTexture.setArg(arg++, optionalArg(dt.bAccumulation));
+            ocl.kBakeTexture.setArg(arg++, dt.imageSize);
+            ocl.kBakeTexture.setArg(arg++, params.stepOut);
+            ocl.kBakeTexture.setArg(arg++, params.samplesPerAxis);
+            ocl.kBakeTexture.setArg(arg++, end);
+            
+            // Work items beyond end are discarded by the kernel. The global
+            // offset makes get_global_id start at begin.
+            const int n = end - begin;
+            const int nDivisableBy2 = n + n % 2;
+            
+            cl::Event e;
+            cl_int err = ocl.q.enqueueNDRangeKernel(ocl.kBakeTexture, cl::NDRange(begin), globalRange(ocl, "bakeTextureMap", nDivisableBy2), localRange(ocl, "bakeTextureMap"), &dt.uploaded, &e);
+            ASSERT_OPENCL(err, "Failed to run bake kernel.");
+            kernels.push_back(e);
+            
+            return true;
+        }
+        
+        /** 
+            Enqueue sorting of the texel list by ray keys. 
+         
+            Keys and texels are radix sorted in an even number of passes, so the sorted 
+            texels end up in the texel list again. The list holds at most capacity texels.
+         */
+        bool enqueueSortTexels(OCL &ocl, const DeviceSource &ds, const DeviceTarget &dt, const BakeParameters &params,
+                               int capacity, std::vector<cl::Event> &kernels)
+        {
+            const int groupSize = ocl.radixGroupSize;
+            const int nBlocks = (capacity + groupSize - 1) / groupSize;
+            const int nCounts = nBlocks * RadixBuckets;
+            const SurfaceVolume &sv = *ds.sv;
+            cl_int err;
+            cl::Event e;
+            
+            float minmax[8] = {
+                sv.bounds.min().x(), sv.bounds.min().y(), sv.bounds.min().z(), 0.f,
+                sv.bounds.max().x(), sv.bounds.max().y(), sv.bounds.max().z(), 0.f,
+            };
+            
+            ocl.kComputeRayKeys.setArg(0, *dt.bTexels);
+            ocl.kComputeRayKeys.setArg(1, *dt.bTexelCount);
+            ocl.kComputeRayKeys.setArg(2, *dt.bTexelTriangles);
+            ocl.kComputeRayKeys.setArg(3, *dt.bTexelBarycentrics);
+            ocl.kComputeRayKeys.setArg(4, *dt.bTargetVertexPositions);
+            ocl.kComputeRayKeys.setArg(5, *dt.bTargetVertexNormals);
+            ocl.kComputeRayKeys.setArg(6, carray(minmax, 8));
+            ocl.kComputeRayKeys.setArg(7, params.stepOut);
+            ocl.kComputeRayKeys.setArg(8, *dt.bRayKeys);
+            
+            err = ocl.q.enqueueNDRangeKernel(ocl.kComputeRayKeys, cl::NullRange, cl::NDRange(capacity), cl::NullRange, 0, &e);
+            ASSERT_OPENCL(err, "Failed to run ray key kernel.");
+            kernels.push_back(e);
+            
+            const cl::Buffer *keys[2] = {dt.bRayKeys.get(), dt.bRayKeysAlt.get()};
+            const cl::Buffer *values[2] = {dt.bTexels.get(), dt.bTexelsAlt.get()};
+            
+            for (int pass = 0; pass < RadixPasses; ++pass) {
+                const int in = pass % 2;
+                const int shift = pass * RadixBits;
+                
+                ocl.kRadixHistogram.setArg(0, *keys[in]);
+                ocl.kRadixHistogram.setArg(1, *dt.bTexelCount);
+                ocl.kRadixHistogram.setArg(2, *dt.bRadixCounts);
+                ocl.kRadixHistogram.setArg(3, shift);
+                
+                err = ocl.q.enqueueNDRangeKernel(ocl.kRadixHistogram, cl::NullRange, cl::NDRange(nBlocks * groupSize), cl::NDRange(groupSize), 0, &e);
+                ASSERT_OPENCL(err, "Failed to run radix histogram kernel.");
+                kernels.push_back(e);
+                
+                ocl.kScanCounts.setArg(0, *dt.bRadixCounts);
+                ocl.kScanCounts.setArg(1, *dt.bRadixOffsets);
+                ocl.kScanCounts.setArg(2, *dt.bRadixCursors);
+                ocl.kScanCounts.setArg(3, nCounts);
+                ocl.kScanCounts.setArg(4, cl::__local(ocl.scanGroupSize * sizeof(cl_int)));
+                
+                err = ocl.q.enqueueNDRangeKernel(ocl.kScanCounts, cl::NullRange, cl::NDRange(ocl.scanGroupSize), cl::NDRange(ocl.scanGroupSize), 0, &e);
+                ASSERT_OPENCL(err, "Failed to run radix scan kernel.");
+                kernels.push_back(e);
+                
+                ocl.kRadixScatter.setArg(0, *keys[in]);
+                ocl.kRadixScatter.setArg(1, *values[in]);
+                ocl.kRadixScatter.setArg(2, *keys[1 - in]);
+                ocl.kRadixScatter.setArg(3, *values[1 - in]);
+                ocl.kRadixScatter.setArg(4, *dt.bTexelCount);
+                ocl.kRadixScatter.setArg(5, *dt.bRadixOffsets);
+                ocl.kRadixScatter.setArg(6, shift);
+                ocl.kRadixScatter.setArg(7, cl::__local(groupSize * sizeof(cl_int)));
+                
+                err = ocl.q.enqueueNDRangeKernel(ocl.kRadixScatter, cl::NullRange, cl::NDRange(nBlocks * groupSize), cl::NDRange(groupSize), 0, &e);
+                ASSERT_OPENCL(err, "Failed to run radix scatter kernel.");
+                kernels.push_back(e);
+            }
+            
+            return true;
+        }
+        
+        /** Enqueue rasterization of target triangles in [begin, end) into the texel map. Waits for target uploads. */
+        bool enqueueRasterizeTexels(OCL &ocl, const DeviceTarget &dt, const BakeParameters &params,
+                                    int begin, int end, std::vector<cl::Event> &kernels)
+        {
+            ocl.kRasterizeTexels.setArg(0, *dt.bTargetVertexUVs);
+            ocl.kRasterizeTexels.setArg(1, *dt.bTexelTriangles);
+            ocl.kRasterizeTexels.setArg(2, dt.imageSize);
+            ocl.kRasterizeTexels.setArg(3, params.samplesPerAxis);
+            ocl.kRasterizeTexels.setArg(4, end);
+            
+            cl::Event e;
+            cl_int err = ocl.q.enqueueNDRangeKernel(ocl.kRasterizeTexels, cl::NDRange(begin), globalRange(ocl, "rasterizeTexels", end - begin), localRange(ocl, "rasterizeTexels"), &dt.uploaded, &e);
+            ASSERT_OPENCL(err, "Failed to run rasterization kernel.");
+            kernels.push_back(e);
+            
+            return true;
+        }
+        
+        /** 
+            Enqueue compaction of mapped texels in [first, last) of the texel map into the 
+            texel list. Sorts the list when ray sorting is enabled.
+         */
+        bool enqueueTexelList(OCL &ocl, const DeviceSource &ds, const DeviceTarget &dt, const BakeParameters &params,
+                              int first, int last, std::vector<cl::Event> &kernels)
+        {
+            if (!enqueueFillInt(ocl, ocl.q, *dt.bTexelCount, 0, 1, 0)) {
+                return false;
+            }
+            
+            ocl.kCompactTexels.setArg(0, *dt.bTargetVertexUVs);
+            ocl.kCompactTexels.setArg(1, *dt.bTexelTriangles);
+            ocl.kCompactTexels.setArg(2, *dt.bTexelBarycentrics);
+            ocl.kCompactTexels.setArg(3, *dt.bTexels);
+            ocl.kCompactTexels.setArg(4, *dt.bTexelCount);
+            ocl.kCompactTexels.setArg(5, dt.imageSize);
+            ocl.kCompactTexels.setArg(6, params.samplesPerAxis);
+            ocl.kCompactTexels.setArg(7, last);
+            
+            cl::Event e;
+            cl_int err = ocl.q.enqueueNDRangeKernel(ocl.kCompactTexels, cl::NDRange(first), globalRange(ocl, "compactTexels", last - first), localRange(ocl, "compactTexels"), 0, &e);
+            ASSERT_OPENCL(err, "Failed to run compaction kernel.");
+            kernels.push_back(e);
+            
+            if (dt.sortRays) {
+                return enqueueSortTexels(ocl, ds, dt, params, last - first, kernels);
+            }
+            
+            return true;
+        }
+        
+        /** Set texel map, target, source and bake arguments of the texel kernels starting at index first. */
+        void setTexelBakeArgs(cl::Kernel &k, int first, const DeviceSource &ds, const DeviceTarget &dt, const BakeParameters &params)
+        {
+            k.setArg(first + 0, *dt.bTexelTriangles);
+            k.setArg(first + 1, *dt.bTexelBarycentrics);
+            k.setArg(first + 2, *dt.bTargetVertexPositions);
+            k.setArg(first + 3, *dt.bTargetVertexNormals);
+            k.setArg(first + 4, *dt.bTargetVertexUVs);
+            int arg = setSourceArgs(k, first + 5, ds);
+            k.setArg(arg++, *dt.bTexture);
+            k.setArg(arg++, optionalArg(dt.bCoverage));
+            k.setArg(arg++, dt.imageSize);
+            k.setArg(arg++, params.stepOut);
+            k.setArg(arg++, params.samplesPerAxis);
+        }
+        
+        /** 
+            Enqueue texel list construction over texels in [first, last) followed by one 
+            work-item per listed texel.
+         
+            The length of the texel list is only known on the device, so the bake kernel 
+            is launched for all texels of the range and surplus work-items exit immediately.
+         */
+        bool enqueuePerTexel(OCL &ocl, const DeviceSource &ds, const DeviceTarget &dt, const BakeParameters &params,
+                             int first, int last, std::vector<cl::Event> &kernels)
+        {
+            if (!enqueueTexelList(ocl, ds, dt, params, first, last, kernels)) {
+                return false;
+            }
+            
+            ocl.kBakeTexels.setArg(0, *dt.bTexels);
+            ocl.kBakeTexels.setArg(1, *dt.bTexelCount);
+            setTexelBakeArgs(ocl.kBakeTexels, 2, ds, dt, params);
+            
+            cl::Event e;
+            cl_int err = ocl.q.enqueueNDRangeKernel(ocl.kBakeTexels, cl::NullRange, globalRange(ocl, "bakeTexels", last - first), localRange(ocl, "bakeTexels"), 0, &e);
+            ASSERT_OPENCL(err, "Failed to run bake kernel.");
+            kernels.push_back(e);
+            
+            return true;
+        }
+        
+        /** Enqueue texel list construction over texels in [first, last) followed by persistent work-groups draining the list. */
+        bool enqueuePersistent(OCL &ocl, const DeviceSource &ds, const DeviceTarget &dt, const BakeParameters &params,
+                               int first, int last, std::vector<cl::Event> &kernels)
+        {
+            if (!enqueueTexelList(ocl, ds, dt, params, first, last, kernels)) {
+                return false;
+            }
+            
+            if (!enqueueFillInt(ocl, ocl.q, *dt.bNextTexel, 0, 1, 0)) {
+                return false;
+            }
+            
+            ocl.kBakeTexelsPersistent.setArg(0, *dt.bTexels);
+            ocl.kBakeTexelsPersistent.setArg(1, *dt.bTexelCount);
+            ocl.kBakeTexelsPersistent.setArg(2, *dt.bNextTexel);
+            setTexelBakeArgs(ocl.kBakeTexelsPersistent, 3, ds, dt, params);
+            
+            const int groupSize = ocl.persistentGroupSize;
+            
+            cl::Event e;
+            cl_int err = ocl.q.enqueueNDRangeKernel(ocl.kBakeTexelsPersistent, cl::NullRange, cl::NDRange(ocl.persistentGroups * groupSize), cl::NDRange(groupSize), 0, &e);
+            ASSERT_OPENCL(err, "Failed to run persistent bake kernel.");
+            kernels.push_back(e);
+            
+            return true;
+        }
+        
+        /** 
+            Enqueue texel list construction over texels in [first, last) followed by the 
+            wavefront pipeline. 
+         
+            The list is processed in waves of rays covering whole texels. Waves beyond the 
+            list length, which is only known on the device, exit immediately.
+         */
+        bool enqueueWavefront(OCL &ocl, const DeviceSource &ds, const DeviceTarget &dt, const BakeParameters &params,
+                              int first, int last, std::vector<cl::Event> &kernels)
+        {
+            if (!enqueueTexelList(ocl, ds, dt, params, first, last, kernels)) {
+                return false;
+            }
+            
+            const int samplesPerTexel = params.samplesPerAxis * params.samplesPerAxis;
+            const int waveTexels = dt.waveRays / samplesPerTexel;
+            cl_int err;
+            
+            ocl.kGenerateRays.setArg(0, *dt.bTexels);
+            ocl.kGenerateRays.setArg(1, *dt.bTexelCount);
+            ocl.kGenerateRays.setArg(2, *dt.bTexelTriangles);
+            ocl.kGenerateRays.setArg(3, *dt.bTexelBarycentrics);
+            ocl.kGenerateRays.setArg(4, *dt.bTargetVertexPositions);
+            ocl.kGenerateRays.setArg(5, *dt.bTargetVertexNormals);
+            ocl.kGenerateRays.setArg(6, *dt.bTargetVertexUVs);
+            ocl.kGenerateRays.setArg(7, dt.imageSize);
+            ocl.kGenerateRays.setArg(8, params.stepOut);
+            ocl.kGenerateRays.setArg(9, params.samplesPerAxis);
+            ocl.kGenerateRays.setArg(11, dt.waveRays);
+            ocl.kGenerateRays.setArg(12, *dt.bRayOrigins);
+            ocl.kGenerateRays.setArg(13, *dt.bRayDirections);
+            
+            ocl.kTraceRays.setArg(0, *dt.bRayOrigins);
+            ocl.kTraceRays.setArg(1, *dt.bRayDirections);
+            ocl.kTraceRays.setArg(2, dt.waveRays);
+            int arg = setSourceArgs(ocl.kTraceRays, 3, ds);
+            ocl.kTraceRays.setArg(arg++, *dt.bHits);
+            
+            ocl.kShadeTexels.setArg(0, *dt.bTexels);
+            ocl.kShadeTexels.setArg(1, *dt.bTexelCount);
+            ocl.kShadeTexels.setArg(2, *dt.bHits);
+            ocl.kShadeTexels.setArg(3, *ds.bSrcVertexColors);
+            ocl.kShadeTexels.setArg(4, *dt.bTexture);
+            ocl.kShadeTexels.setArg(5, optionalArg(dt.bCoverage));
+            ocl.kShadeTexels.setArg(6, dt.imageSize);
+            ocl.kShadeTexels.setArg(7, params.samplesPerAxis);
+            ocl.kShadeTexels.setArg(9, waveTexels);
+            
+            for (int wave = 0; wave < last - first; wave += waveTexels) {
+                cl::Event e;
+                
+                ocl.kGenerateRays.setArg(10, wave);
+                err = ocl.q.enqueueNDRangeKernel(ocl.kGenerateRays, cl::NullRange, globalRange(ocl, "generateRays", dt.waveRays), localRange(ocl, "generateRays"), 0, &e);
+                ASSERT_OPENCL(err, "Failed to run ray generation kernel.");
+                kernels.push_back(e);
+                
+                err = ocl.q.enqueueNDRangeKernel(ocl.kTraceRays, cl::NullRange, globalRange(ocl, "traceRays", dt.waveRays), localRange(ocl, "traceRays"), 0, &e);
+                ASSERT_OPENCL(err, "Failed to run trace kernel.");
+                kernels.push_back(e);
+                
+                ocl.kShadeTexels.setArg(8, wave);
+                err = ocl.q.enqueueNDRangeKernel(ocl.kShadeTexels, cl::NullRange, globalRange(ocl, "shadeTexels", waveTexels), localRange(ocl, "shadeTexels"), 0, &e);
+                ASSERT_OPENCL(err, "Failed to run shade kernel.");
+                kernels.push_back(e);
+            }
+            
+            return true;
+        }
+        
+        /** Enqueue binning of target triangles in [begin, end) into tiles. Waits for target uploads. */
+        bool enqueueBinTiles(OCL &ocl, const DeviceTarget &dt, const BakeParameters &params,
+                             int begin, int end, std::vector<cl::Event> &kernels)
+        {
+            const int nTiles = dt.tilesPerRow * dt.tilesPerRow;
+            cl_int err;
+            cl::Event e;
+            
+            if (!enqueueFillInt(ocl, ocl.q, *dt.bTileCounts, 0, nTiles, 0)) {
+                return false;
+            }
+            
+            ocl.kCountTileTriangles.setArg(0, *dt.bTargetVertexUVs);
+            ocl.kCountTileTriangles.setArg(1, *dt.bTileCounts);
+            ocl.kCountTileTriangles.setArg(2, dt.imageSize);
+            ocl.kCountTileTriangles.setArg(3, params.samplesPerAxis);
+            ocl.kCountTileTriangles.setArg(4, end);
+            
+            err = ocl.q.enqueueNDRangeKernel(ocl.kCountTileTriangles, cl::NDRange(begin), cl::NDRange(end - begin), cl::NullRange, &dt.uploaded, &e);
+            ASSERT_OPENCL(err, "Failed to run tile count kernel.");
+            kernels.push_back(e);
+            
+            ocl.kScanCounts.setArg(0, *dt.bTileCounts);
+            ocl.kScanCounts.setArg(1, *dt.bTileOffsets);
+            ocl.kScanCounts.setArg(2, *dt.bTileEnds);
+            ocl.kScanCounts.setArg(3, nTiles);
+            ocl.kScanCounts.setArg(4, cl::__local(ocl.scanGroupSize * sizeof(cl_int)));
+            
+            err = ocl.q.enqueueNDRangeKernel(ocl.kScanCounts, cl::NullRange, cl::NDRange(ocl.scanGroupSize), cl::NDRange(ocl.scanGroupSize), 0, &e);
+            ASSERT_OPENCL(err, "Failed to run tile scan kernel.");
+            kernels.push_back(e);
+            
+            ocl.kBinTileTriangles.setArg(0, *dt.bTargetVertexUVs);
+            ocl.kBinTileTriangles.setArg(1, *dt.bTileEnds);
+            ocl.kBinTileTriangles.setArg(2, *dt.bTileTriangles);
+            ocl.kBinTileTriangles.setArg(3, dt.tileCapacity);
+            ocl.kBinTileTriangles.setArg(4, dt.imageSize);
+            ocl.kBinTileTriangles.setArg(5, params.samplesPerAxis);
+            ocl.kBinTileTriangles.setArg(6, end);
+            
+            err = ocl.q.enqueueNDRangeKernel(ocl.kBinTileTriangles, cl::NDRange(begin), cl::NDRange(end - begin), cl::NullRange, 0, &e);
+            ASSERT_OPENCL(err, "Failed to run tile binning kernel.");
+            kernels.push_back(e);
+            
+            return true;
+        }
+        
+        /** Enqueue one work-group per tile in tile rows [rowBegin, rowEnd) over the binned triangles. */
+        bool enqueueBakeTiles(OCL &ocl, const DeviceSource &ds, const DeviceTarget &dt, const BakeParameters &params,
+                              int rowBegin, int rowEnd, std::vector<cl::Event> &kernels)
+        {
+            if (rowEnd <= rowBegin) {
+                return true;
+            }
+            
+            ocl.kBakeTiles.setArg(0, *dt.bTileOffsets);
+            ocl.kBakeTiles.setArg(1, *dt.bTileEnds);
+            ocl.kBakeTiles.setArg(2, *dt.bTileTriangles);
+            ocl.kBakeTiles.setArg(3, dt.tileCapacity);
+            ocl.kBakeTiles.setArg(4, *dt.bTargetVertexUVs);
+            ocl.kBakeTiles.setArg(5, *dt.bTargetVertexPositions);
+            ocl.kBakeTiles.setArg(6, *dt.bTargetVertexNormals);
+            int arg = setSourceArgs(ocl.kBakeTiles, 7, ds);
+            ocl.kBakeTiles.setArg(arg++, *dt.bTexture);
+            ocl.kBakeTiles.setArg(arg++, optionalArg(dt.bCoverage));
+            ocl.kBakeTiles.setArg(arg++, dt.imageSize);
+            ocl.kBakeTiles.setArg(arg++, params.stepOut);
+            ocl.kBakeTiles.setArg(arg++, params.samplesPerAxis);
+            
+            const int extent = dt.tilesPerRow * BakeTileSize;
+            cl::Event e;
+            cl_int err = ocl.q.enqueueNDRangeKernel(ocl.kBakeTiles, cl::NDRange(0, rowBegin * BakeTileSize), cl::NDRange(extent, (rowEnd - rowBegin) * BakeTileSize),
+                                                    cl::NDRange(BakeTileSize, BakeTileSize), 0, &e);
+            ASSERT_OPENCL(err, "Failed to run tile bake kernel.");
+            kernels.push_back(e);
+            
+            return true;
+        }
+        
+        /** 
+            Enqueue bake kernels for mapped texels in range [first, last) of the texel map. 
+            Triangles need to be rasterized into the map before. Events of enqueued kernels 
+            are appended to kernels, the last one signals completion of the range.
+         */
+        bool enqueueBakeTexels(OCL &ocl, const DeviceSource &ds, const DeviceTarget &dt, const BakeParameters &params,
+                               int first, int last, std::vector<cl::Event> &kernels)
+        {
+            if (last <= first) {
+                return true;
+            }
+            
+            switch (dt.dispatch) {
+                case DispatchPersistent:
+                    return enqueuePersistent(ocl, ds, dt, params, first, last, kernels);
+                case DispatchWavefront:
+                    return enqueueWavefront(ocl, ds, dt, params, first, last, kernels);
+                default:
+                    return enqueuePerTexel(ocl, ds, dt, params, first, last, kernels);
+            }
+        }
+        
+        /** 
+            Enqueue bake kernels for target triangles in range [begin, end). Waits for target 
+            uploads. Events of enqueued kernels are appended to kernels, the last one signals
+            completion of the range. 
+         
+            Dispatch modes using a texel map rasterize the range and bake all texels mapped
+            so far, so they need to be given all triangles at once.
+         */
+        bool enqueueBakeRange(OCL &ocl, const DeviceSource &ds, const DeviceTarget &dt, const BakeParameters &params,
+                              int begin, int end, std::vector<cl::Event> &kernels)
+        {
+            if (end <= begin) {
+                return true;
+            }
+            
+            if (usesTexelMap(dt.dispatch)) {
+                return enqueueRasterizeTexels(ocl, dt, params, begin, end, kernels) &&
+                       enqueueBakeTexels(ocl, ds, dt, params, 0, dt.imageSize * dt.imageSize, kernels);
+            }
+            
+            switch (dt.dispatch) {
+                case DispatchTiled:
+                    return enqueueBinTiles(ocl, dt, params, begin, end, kernels) &&
+                           enqueueBakeTiles(ocl, ds, dt, params, 0, dt.tilesPerRow, kernels);
+                default:
+                    return enqueuePerTriangle(ocl, ds, dt, params, begin, end, kernels);
+            }
+        }
+        
+        /** 
+            Enqueue resolving of accumulated samples into the texture after all ranges were 
+            enqueued. Does nothing unless samples are accumulated.
+         */
+        bool enqueueResolve(OCL &ocl, const DeviceTarget &dt, std::vector<cl::Event> &kernels)
+        {
+            if (!dt.accumulate) {
+                return true;
+            }
+            
+            ocl.kResolveTexels.setArg(0, *dt.bAccumulation);
+            ocl.kResolveTexels.setArg(1, *dt.bTexture);
+            ocl.kResolveTexels.setArg(2, optionalArg(dt.bCoverage));
+            ocl.kResolveTexels.setArg(3, dt.imageSize);
+            
+            cl::Event e;
+            cl_int err = ocl.q.enqueueNDRangeKernel(ocl.kResolveTexels, cl::NullRange, cl::NDRange(dt.imageSize * dt.imageSize), cl::NullRange, &dt.uploaded, &e);
+            ASSERT_OPENCL(err, "Failed to run resolve kernel.");
+            kernels.push_back(e);
+            
+            return true;
+        }
+        
+        /** 
+            Enqueue dilation passes padding UV islands of the texture by the given number 
+            of texels. Passes alternate between two textures and coverage masks, which are 
+            swapped in target so that it refers to the padded result afterwards.
+         */
+        bool enqueueDilate(OCL &ocl, DeviceTarget &dt, int dilation, std::vector<cl::Event> &kernels)
+        {
+            if (dilation <= 0) {
+                return true;
+            }
+            
+            bool ok = ocl.pool.acquireImage(dt.imageSize, dt.imageSize, cl::ImageFormat(CL_RGB, CL_UNORM_INT8), CL_MEM_READ_WRITE, dt.bTextureAlt);
+            ok = ok && ocl.pool.acquireBuffer(dt.imageSize * dt.imageSize, CL_MEM_READ_WRITE, dt.bCoverageAlt);
+            if (!ok) {
+                BAKE_LOG("Failed to create dilation buffers.");
+                return false;
+            }
+            
+            for (int pass = 0; pass < dilation; ++pass) {
+                ocl.kDilateTexels.setArg(0, *dt.bTexture);
+                ocl.kDilateTexels.setArg(1, *dt.bCoverage);
+                ocl.kDilateTexels.setArg(2, *dt.bTextureAlt);
+                ocl.kDilateTexels.setArg(3, *dt.bCoverageAlt);
+                ocl.kDilateTexels.setArg(4, dt.imageSize);
+                
+                cl::Event e;
+                cl_int err = ocl.q.enqueueNDRangeKernel(ocl.kDilateTexels, cl::NullRange, cl::NDRange(dt.imageSize, dt.imageSize), cl::NullRange, &dt.uploaded, &e);
+                ASSERT_OPENCL(err, "Failed to run dilation kernel.");
+                kernels.push_back(e);
+                
+                dt.bTexture.swap(dt.bTextureAlt);
+                dt.bCoverage.swap(dt.bCoverageAlt);
+            }
+            
+            return true;
+        }
+        
+        /** Enqueue non-blocking readback of the device texture on the readback queue after waitFor completed. */
+        bool enqueueReadback(OCL &ocl, const DeviceTarget &dt, Image<unsigned char> &texture, const std::vector<cl::Event> &waitFor, cl::Event *e)
+        {
+            cl::size_t<3> origin, region;
+            imageRegion(dt.imageSize, origin, region);
+            
+            cl_int err = ocl.qr.enqueueReadImage(*dt.bTexture, false, origin, region, 0, 0, texture.row(0), &waitFor, e);
+            ASSERT_OPENCL(err, "Failed to read image.");
+            
+            return true;
+        }
+        
+        /** 
+            Waits for all queues when destroyed unless released. Declared after a local target, 
+            it keeps failure paths from returning pooled memory that queued commands still use.
+         */
+        struct DrainQueues {
+            OCL &ocl;
+            bool active;
+            
+            DrainQueues(OCL &o) : ocl(o), active(true) {}
+            
+            ~DrainQueues()
+            {
+                if (active) {
+                    ocl.qu.finish();
+                    ocl.q.finish();
+                    ocl.qr.finish();
+                }
+            }
+            
+            void release() { active = false; }
+        };
+        
+        /** Enqueue target upload, bake kernel and readback. Returns without waiting for the device. */
+        bool enqueueBake(OCL &ocl, const DeviceSource &ds, const Surface &target, Image<unsigned char> &texture,
+                         const BakeParameters &params, BakeTask::State &state)
+        {
+            DeviceTarget dt;
+            DrainQueues drain(ocl);
+            
+            bool ok = uploadTarget(ocl, target, texture, params, dt);
+            if (ok) {
+                selectKernels(ocl, ds, dt, params);
+            }
+            ok = ok && enqueueBakeRange(ocl, ds, dt, params, 0, dt.nTriangles, state.kernels);
+            ok = ok && enqueueResolve(ocl, dt, state.kernels);
+            ok = ok && enqueueDilate(ocl, dt, params.dilation, state.kernels);
+            
+            // An empty target enqueues no kernel, the readback then only follows the uploads.
+            std::vector<cl::Event> waitFor = state.kernels.empty() ? dt.uploaded : std::vector<cl::Event>(1, state.kernels.back());
+            ok = ok && enqueueReadback(ocl, dt, texture, waitFor, &state.done);
+            if (!ok) {
+                return false;
+            }
+            
+            cl_int err = ocl.q.flush();
+            ASSERT_OPENCL(err, "Failed to submit bake.");
+            err = ocl.qr.flush();
+            ASSERT_OPENCL(err, "Failed to submit bake.");
+            
+            state.uploads = dt.writes;
+            state.clears = dt.clears;
+            appendBuffers(dt, state.buffers);
+            appendImages(dt, state.images);
+            drain.release();
+            
+            return true;
+        }
+        
+        /** Kernels covered by work-group tuning and the dispatch running them. */
+        struct TunedKernel {
+            const char *name;
+            BakeDispatch dispatch;
+        };
+        
+        const TunedKernel TunedKernels[] = {
+            {"bakeTextureMap", DispatchPerTriangle},
+            {"rasterizeTexels", DispatchPerTexel},
+            {"compactTexels", DispatchPerTexel},
+            {"bakeTexels", DispatchPerTexel},
+            {"generateRays", DispatchWavefront},
+            {"traceRays", DispatchWavefront},
+            {"shadeTexels", DispatchWavefront}
+        };
+        
+        /** 
+            Synthetic tuning workload of n x n quads. Source is a wavy height field, target a 
+            flat grid above it whose UVs span the whole texture.
+         */
+        void syntheticSurfaces(int n, Surface &src, Surface &target)
+        {
+            const int nVertices = n * n * 6;
+            src.vertexPositions.resize(4, nVertices);
+            src.vertexNormals.resize(4, nVertices);
+            src.vertexColors.resize(4, nVertices);
+            target.vertexPositions.resize(4, nVertices);
+            target.vertexNormals.resize(4, nVertices);
+            target.vertexUVs.resize(2, nVertices);
+            
+            // Two triangles per quad, given as corner offsets.
+            const int corners[6][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 0}, {1, 1}, {0, 1}};
+            
+            int v = 0;
+            for (int y = 0; y < n; ++y) {
+                for (int x = 0; x < n; ++x) {
+                    for (int i = 0; i < 6; ++i, ++v) {
+                        const float u = float(x + corners[i][0]) / n;
+                        const float w = float(y + corners[i][1]) / n;
+                        const float h = 0.1f * std::sin(u * 18.85f) * std::cos(w * 12.57f);
+                        
+                        src.vertexPositions.col(v) = Eigen::Vector4f(u, w, h, 1.f);
+                        src.vertexNormals.col(v) = Eigen::Vector4f(0.f, 0.f, 1.f, 0.f);
+                        src.vertexColors.col(v) = Eigen::Vector4f(u, w, 0.5f + h, 1.f);
+                        target.vertexPositions.col(v) = Eigen::Vector4f(u, w, 0.2f, 1.f);
+                        target.vertexNormals.col(v) = Eigen::Vector4f(0.f, 0.f, 1.f, 0.f);
+                        target.vertexUVs.col(v) = Eigen::Vector2f(u, w);
+                    }
+                }
+            }
+        }
+        
+        /** Bake and return the summed kernel time in milliseconds, negative on failure. */
+        double timeBake(OCL &ocl, const DeviceSource &ds, const Surface &target, Image<unsigned char> &texture, const BakeParameters &params)
+        {
+            BakeTask::State state;
+            if (!enqueueBake(ocl, ds, target, texture, params, state)) {
+                return -1.0;
+            }
+            
+            if (state.done.wait() != CL_SUCCESS) {
+                return -1.0;
+            }
+            
+            double ms = 0.0;
+            for (auto iter = state.kernels.begin(); iter != state.kernels.end(); ++iter) {
+                ms += (iter->getProfilingInfo<CL_PROFILING_COMMAND_END>() - iter->getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-6;
+            }
+            return ms;
+        }
+        
+        /** 
+            Choose local work sizes of tuned kernels by timing synthetic bakes. Kernels are
+            tuned one after another, each keeping the best size of the ones before. Stores 
+            the resulting profile when caching is enabled.
+         */
+        bool tuneLocalSizes(OCL &ocl)
+        {
+            Surface src, target;
+            syntheticSurfaces(64, src, target);
+            
+            std::shared_ptr<SurfaceVolume> sv;
+            DeviceSource ds;
+            if (!buildSourceVolume(src, GridSettings(), sv) || !uploadSource(ocl, src, sv, ds)) {
+                return false;
+            }
+            
+            Image<unsigned char> texture(256, 256, 3);
+            
+            // Variants would be built for the synthetic launch constants only.
+            const bool specialize = ocl.specialize;
+            ocl.specialize = false;
+            ocl.localSizes.clear();
+            
+            const int nRuns = 3;
+            bool ok = true;
+            
+            for (size_t t = 0; ok && t < sizeof(TunedKernels) / sizeof(TunedKernels[0]); ++t) {
+                const TunedKernel &tk = TunedKernels[t];
+                
+                cl::Kernel k;
+                if (!createKernel(ocl.prg, tk.name, k)) {
+                    ok = false;
+                    break;
+                }
+                
+                const int maxSize = static_cast<int>(k.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(ocl.d));
+                const int multiple = static_cast<int>(k.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(ocl.d));
+                
+                // Zero lets the driver choose and is always a candidate.
+                std::vector<int> candidates(1, 0);
+                candidates.push_back(multiple);
+                for (int size = 16; size <= 512; size *= 2) {
+                    candidates.push_back(size);
+                }
+                std::sort(candidates.begin(), candidates.end());
+                candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+                
+                BakeParameters params;
+                params.dispatch = tk.dispatch;
+                
+                int best = 0;
+                double bestMs = -1.0;
+                
+                for (auto c = candidates.begin(); c != candidates.end(); ++c) {
+                    if (*c > maxSize) {
+                        continue;
+                    }
+                    
+                    ocl.localSizes[tk.name] = *c;
+                    
+                    double ms = -1.0;
+                    for (int run = 0; run < nRuns; ++run) {
+                        const double runMs = timeBake(ocl, ds, target, texture, params);
+                        if (runMs < 0.0) {
+                            ms = -1.0;
+                            break;
+                        }
+                        ms = (ms < 0.0) ? runMs : std::min(ms, runMs);
+                    }
+                    
+                    if (ms >= 0.0 && (bestMs < 0.0 || ms < bestMs)) {
+                        best = *c;
+                        bestMs = ms;
+                    }
+                }
+                
+                if (bestMs < 0.0) {
+                    BAKE_LOG("Failed to time %s.", tk.name);
+                    ok = false;
+                    break;
+                }
+                
+                ocl.localSizes[tk.name] = best;
+                BAKE_LOG("Tuned %s to local size %d, %.3f ms.", tk.name, best, bestMs);
+            }
+            
+            ocl.specialize = specialize;
+            
+            // Variants were checked against the previous local sizes.
+            ocl.variants.clear();
+            
+            if (!ok) {
+                ocl.localSizes.clear();
+                return false;
+            }
+            
+            if (!ocl.cacheDir.empty() && !storeWorkGroupProfile(ocl.cacheDir, ocl.profileKey, ocl.localSizes)) {
+                BAKE_LOG("Failed to store work-group profile.");
+            }
+            
+            return true;
+        }
+        
+        bool Baker::tuneWorkGroupSizes()
+        {
+            if (!_data->initialized) {
+                BAKE_LOG("Baker is not initialized.");
+                return false;
+            }
+            
+            return tuneLocalSizes(_data->ocl);
+        }
+        
+        BakeTask Baker::bakeTextureMapAsync(const Surface &target, Image<unsigned char> &texture, const BakeParameters &params, const BakeCallback &callback)
+        {
+            BakeTask task;
+            
+            if (!_data->initialized) {
+                BAKE_LOG("Baker is not initialized.");
+                return task;
+            }
+            
+            if (!_data->source.valid) {
+                BAKE_LOG("No source set.");
+                return task;
+            }
+            
+            if (texture.rows() == 0 || texture.rows() != texture.cols() || texture.channels() != 3) {
+                BAKE_LOG("Texture needs to be a square three channel image.");
+                return task;
+            }
+            
+            if (!validParameters(params)) {
+                return task;
+            }
+            
+            std::shared_ptr<BakeTask::State> state(new BakeTask::State());
+            
+            // Source buffers are shared by all bakes, but need to outlive this one.
+            state->buffers.push_back(_data->source.bSrcVertexPositions);
+            state->buffers.push_back(_data->source.bSrcVertexNormals);
+            state->buffers.push_back(_data->source.bSrcVertexColors);
+            state->buffers.push_back(_data->source.bSrcVoxels);
+            state->buffers.push_back(_data->source.bSrcTrianglesInVoxels);
+            state->volume = _data->source.sv;
+            
+            if (!enqueueBake(_data->ocl, _data->source, target, texture, params, *state)) {
+                return task;
+            }
+            
+            BakeCompletion *c = new BakeCompletion();
+            c->buffers.swap(state->buffers);
+            c->images.swap(state->images);
+            c->volume.swap(state->volume);
+            c->callback = callback;
+            
+            if (state->done.setCallback(CL_COMPLETE, onBakeCompleted, c) != CL_SUCCESS) {
+                BAKE_LOG("Failed to register bake completion callback.");
+                state->done.wait();
+                onBakeCompleted(state->done(), state->done.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>(), c);
+            }
+            
+            task._state = state;
+            return task;
+        }
+        
+        BakeTask Baker::bakeTextureMapAsync(const Surface &src, const Surface &target, Image<unsigned char> &texture, const BakeCallback &callback)
+        {
+            if (!setSource(src)) {
+                return BakeTask();
+            }
+            
+            return bakeTextureMapAsync(target, texture, BakeParameters(), callback);
+        }
+        
+        bool Baker::bakeTextureMap(const Surface &src, const Surface &target, Image<unsigned char> &texture) {
+            BakeTask task = bakeTextureMapAsync(src, target, texture);
+            return task.wait();
+        }
+        
+        /** Accumulates profiled command durations and the time span covered by all commands. */
+        struct CommandTimes {
+            cl_ulong busy;
+            cl_ulong first;
+            cl_ulong last;
+            
+            CommandTimes() : busy(0), first(~cl_ulong(0)), last(0) {}
+            
+            void add(const cl::Event &e)
+            {
+                if (!e()) {
+                    return;
+                }
+                
+                cl_ulong start = e.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+                cl_ulong end = e.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+                busy += end - start;
+                first = std::min(first, start);
+                last = std::max(last, end);
+            }
+        };
+        
+        bool Baker::bakeTextureMaps(const Surface &src, const std::vector<BakeTarget> &targets, PipelineStats *stats)
+        {
+            if (!setSource(src)) {
+                return false;
+            }
+            
+            // Keep three bakes in flight, so that upload of the next target and readback
+            // of the previous one overlap the current kernel, without holding the device
+            // memory of all targets at once.
+            const size_t maxInFlight = 3;
+            
+            std::vector<BakeTask> tasks(targets.size());
+            bool success = true;
+            
+            for (size_t i = 0; i < targets.size(); ++i) {
+                if (i >= maxInFlight && tasks[i - maxInFlight].valid()) {
+                    success &= tasks[i - maxInFlight].wait();
+                }
+                
+                const BakeTarget &t = targets[i];
+                tasks[i] = bakeTextureMapAsync(*t.surface, *t.texture, t.params);
+                if (!tasks[i].valid()) {
+                    BAKE_LOG("Failed to enqueue target #%d.", (int)i);
+                    success = false;
+                }
+            }
+            
+            const size_t first = targets.size() > maxInFlight ? targets.size() - maxInFlight : 0;
+            for (size_t i = first; i < targets.size(); ++i) {
+                if (tasks[i].valid()) {
+                    success &= tasks[i].wait();
+                }
+            }
+            
+            if (stats && success) {
+                CommandTimes uploads, kernels, readbacks, all;
+                for (auto iter = tasks.begin(); iter != tasks.end(); ++iter) {
+                    if (!iter->_state) {
+                        continue;
+                    }
+                    
+                    const BakeTask::State &st = *iter->_state;
+                    for (auto e = st.uploads.begin(); e != st.uploads.end(); ++e) {
+                        uploads.add(*e);
+                        all.add(*e);
+                    }
+                    for (auto e = st.clears.begin(); e != st.clears.end(); ++e) {
+                        kernels.add(*e);
+                        all.add(*e);
+                    }
+                    for (auto e = st.kernels.begin(); e != st.kernels.end(); ++e) {
+                        kernels.add(*e);
+                        all.add(*e);
+                    }
+                    readbacks.add(st.done);
+                    all.add(st.done);
+                }
+                
+                stats->uploadMs = uploads.busy * 1e-6;
+                stats->kernelMs = kernels.busy * 1e-6;
+                stats->readbackMs = readbacks.busy * 1e-6;
+                stats->wallMs = (all.last > all.first) ? (all.last - all.first) * 1e-6 : 0.0;
+                
+                const double busyMs = stats->uploadMs + stats->kernelMs + stats->readbackMs;
+                stats->overlap = (busyMs > 0.0) ? std::max(0.0, 1.0 - stats->wallMs / busyMs) : 0.0;
+                
+                BAKE_LOG("Pipeline: upload %.2fms, kernel %.2fms, readback %.2fms, wall %.2fms, overlap %.1f%%",
+                         stats->uploadMs, stats->kernelMs, stats->readbackMs, stats->wallMs, stats->overlap * 100.0);
+            }
+            
+            return success;
+        }
+        
+        /** Device state of a multi device baker. */
+        struct DeviceSlot {
+            OCL ocl;
+            DeviceSource source;
+        };
+        
+        struct MultiBaker::Data {
+            std::vector< std::unique_ptr<DeviceSlot> > devices;
+            std::string programCacheDir;
+            HostMemoryMode hostMemoryMode;
+            int chunkSize;
+            bool specialize;
+            bool hasSource;
+            GridSettings grid;
+            
+            Data() : hostMemoryMode(HostMemoryAuto), chunkSize(0), specialize(false), hasSource(false) {}
+        };
+        
+        MultiBaker::MultiBaker()
+        : _data(new Data())
+        {}
+        
+        MultiBaker::~MultiBaker()
+        {}
+        
+        void MultiBaker::setProgramCacheDirectory(const std::string &dir)
+        {
+            _data->programCacheDir = dir;
+        }
+        
+        void MultiBaker::setHostMemoryMode(HostMemoryMode mode)
+        {
+            _data->hostMemoryMode = mode;
+        }
+        
+        void MultiBaker::setChunkSize(int n)
+        {
+            _data->chunkSize = n;
+        }
+        
+        void MultiBaker::setGridResolution(const Eigen::Vector3i &voxelsPerDimension)
+        {
+            _data->grid.voxelsPerDimension = voxelsPerDimension;
+        }
+        
+        void MultiBaker::setGridDensity(float trianglesPerVoxel)
+        {
+            _data->grid.trianglesPerVoxel = trianglesPerVoxel;
+        }
+        
+        void MultiBaker::setGridType(GridType type)
+        {
+            _data->grid.type = type;
+        }
+        
+        void MultiBaker::setKernelSpecialization(bool enable)
+        {
+            _data->specialize = enable;
+            for (auto iter = _data->devices.begin(); iter != _data->devices.end(); ++iter) {
+                (*iter)->ocl.specialize = enable;
+            }
+        }
+        
+        bool MultiBaker::init(const std::vector<int> &deviceIds)
+        {
+            _data->devices.clear();
+            _data->hasSource = false;
+            
+            for (auto iter = deviceIds.begin(); iter != deviceIds.end(); ++iter) {
+                std::unique_ptr<DeviceSlot> slot(new DeviceSlot());
+                if (!initOpenCL(slot->ocl, *iter, _data->programCacheDir)) {
+                    BAKE_LOG("Failed to initialize device #%d.", *iter);
+                    _data->devices.clear();
+                    return false;
+                }
+                configureHostMemory(slot->ocl, _data->hostMemoryMode);
+                slot->ocl.specialize = _data->specialize;
+                _data->devices.push_back(std::move(slot));
+            }
+            
+            if (_data->devices.empty()) {
+                BAKE_LOG("No devices to initialize.");
+                return false;
+            }
+            
+            return true;
+        }
+        
+        bool MultiBaker::init()
+        {
+            std::vector<DeviceInfo> infos = listDevices();
+            
+            std::vector<int> ids;
+            for (auto iter = infos.begin(); iter != infos.end(); ++iter) {
+                if (iter->imageSupport) {
+                    ids.push_back(iter->id);
+                }
+            }
+            
+            return init(ids);
+        }
+        
+        bool MultiBaker::tuneWorkGroupSizes()
+        {
+            if (_data->devices.empty()) {
+                BAKE_LOG("MultiBaker is not initialized.");
+                return false;
+            }
+            
+            for (auto iter = _data->devices.begin(); iter != _data->devices.end(); ++iter) {
+                if (!tuneLocalSizes((*iter)->ocl)) {
+                    return false;
+                }
+            }
+            
+            return true;
+        }
+        
+        int MultiBaker::deviceCount() const
+        {
+            return static_cast<int>(_data->devices.size());
+        }
+        
+        bool MultiBaker::setSource(const Surface &src)
+        {
+            _data->hasSource = false;
+            
+            if (_data->devices.empty()) {
+                BAKE_LOG("MultiBaker is not initialized.");
+                return false;
+            }
+            
+            // Volume is built once and replicated to all devices.
+            std::shared_ptr<SurfaceVolume> sv;
+            if (!buildSourceVolume(src, _data->grid, sv)) {
+                return false;
+            }
+            
+            for (auto iter = _data->devices.begin(); iter != _data->devices.end(); ++iter) {
+                if (!uploadSource((*iter)->ocl, src, sv, (*iter)->source)) {
+                    return false;
+                }
+            }
+            
+            _data->hasSource = true;
+            return true;
+        }
+        
+        /** 
+            Bake chunks of target triangles pulled from a shared counter until none are left. 
+            Dispatch modes using a texel map rasterize all triangles once and chunk texels of
+            the map instead, so that each chunk only pays for its own texels.
+         
+            Two chunks are kept in flight, so the device does not idle while the next chunk
+            is enqueued. When coverage is given, edge padding is left to the caller and the 
+            coverage mask of the bake is read back into it.
+         */
+        bool bakeChunks(DeviceSlot &slot, const Surface &target, Image<unsigned char> &texture, const BakeParameters &params,
+                        int chunkSize, int nChunks, std::atomic<int> &nextChunk, std::vector<unsigned char> *coverage)
+        {
+            OCL &ocl = slot.ocl;
+            
+            DeviceTarget dt;
+            DrainQueues drain(ocl);
+            
+            if (!uploadTarget(ocl, target, texture, params, dt, coverage != 0)) {
+                return false;
+            }
+            selectKernels(ocl, slot.source, dt, params);
+            
+            std::deque<cl::Event> inFlight;
+            std::vector<cl::Event> lastKernel;
+            
+            // Texel and tiled dispatch map all triangles once and chunk by texels or tile rows, 
+            // so that devices bake disjoint parts of the texture.
+            const bool texelChunks = usesTexelMap(dt.dispatch);
+            const bool tileChunks = dt.dispatch == DispatchTiled;
+            if (texelChunks || tileChunks) {
+                std::vector<cl::Event> kernels;
+                const bool ok = texelChunks ? enqueueRasterizeTexels(ocl, dt, params, 0, dt.nTriangles, kernels)
+                                            : enqueueBinTiles(ocl, dt, params, 0, dt.nTriangles, kernels);
+                if (!ok) {
+                    return false;
+                }
+            }
+            const int nItems = texelChunks ? dt.imageSize * dt.imageSize : (tileChunks ? dt.tilesPerRow : dt.nTriangles);
+            
+            int chunk;
+            while ((chunk = nextChunk++) < nChunks) {
+                const int begin = chunk * chunkSize;
+                const int end = std::min(begin + chunkSize, nItems);
+                
+                std::vector<cl::Event> kernels;
+                bool ok;
+                if (texelChunks) {
+                    ok = enqueueBakeTexels(ocl, slot.source, dt, params, begin, end, kernels);
+                } else if (tileChunks) {
+                    ok = enqueueBakeTiles(ocl, slot.source, dt, params, begin, end, kernels);
+                } else {
+                    ok = enqueueBakeRange(ocl, slot.source, dt, params, begin, end, kernels);
+                }
+                if (!ok) {
+                    return false;
+                }
+                if (kernels.empty()) {
+                    continue;
+                }
+                ocl.q.flush();
+                inFlight.push_back(kernels.back());
+                lastKernel.assign(1, kernels.back());
+                
+                if (inFlight.size() >= 2) {
+                    inFlight.front().wait();
+                    inFlight.pop_front();
+                }
+            }
+            
+            std::vector<cl::Event> finish;
+            bool ok = enqueueResolve(ocl, dt, finish);
+            ok = ok && enqueueDilate(ocl, dt, coverage ? 0 : params.dilation, finish);
+            if (!ok) {
+                return false;
+            }
+            if (!finish.empty()) {
+                ocl.q.flush();
+                lastKernel.assign(1, finish.back());
+            }
+            
+            if (lastKernel.empty()) {
+                lastKernel = dt.uploaded;
+            }
+            
+            cl::Event done;
+            if (!enqueueReadback(ocl, dt, texture, lastKernel, &done)) {
+                return false;
+            }
+            
+            cl::Event coverageDone;
+            if (coverage) {
+                coverage->resize(dt.imageSize * dt.imageSize);
+                cl_int err = ocl.qr.enqueueReadBuffer(*dt.bCoverage, false, 0, coverage->size(), coverage->data(), &lastKernel, &coverageDone);
+                ASSERT_OPENCL(err, "Failed to read coverage mask.");
+            }
+            ocl.qr.flush();
+            
+            cl_int err = done.wait();
+            ASSERT_OPENCL(err, "Failed to wait for bake.");
+            if (coverage) {
+                err = coverageDone.wait();
+                ASSERT_OPENCL(err, "Failed to wait for bake.");
+            }
+            
+            return true;
+        }
+        
+        /** Pad UV islands of a host texture on the device, coverage marking the texels baked. Blocks until done. */
+        bool dilateTexture(OCL &ocl, Image<unsigned char> &texture, const std::vector<unsigned char> &coverage, int dilation)
+        {
+            DeviceTarget dt;
+            DrainQueues drain(ocl);
+            dt.imageSize = texture.rows();
+            
+            bool ok = ocl.pool.acquireImage(dt.imageSize, dt.imageSize, cl::ImageFormat(CL_RGB, CL_UNORM_INT8), CL_MEM_READ_WRITE, dt.bTexture);
+            ok = ok && ocl.pool.acquireBuffer(coverage.size(), CL_MEM_READ_WRITE, dt.bCoverage);
+            if (!ok) {
+                BAKE_LOG("Failed to create dilation buffers.");
+                return false;
+            }
+            
+            cl::size_t<3> origin, region;
+            imageRegion(dt.imageSize, origin, region);
+            
+            cl::Event e;
+            cl_int err = ocl.qu.enqueueWriteImage(*dt.bTexture, false, origin, region, 0, 0, texture.row(0), 0, &e);
+            ASSERT_OPENCL(err, "Failed to write texture image.");
+            dt.uploaded.push_back(e);
+            
+            err = ocl.qu.enqueueWriteBuffer(*dt.bCoverage, false, 0, coverage.size(), coverage.data(), 0, &e);
+            ASSERT_OPENCL(err, "Failed to write coverage mask.");
+            dt.uploaded.push_back(e);
+            ocl.qu.flush();
+            
+            std::vector<cl::Event> kernels;
+            if (!enqueueDilate(ocl, dt, dilation, kernels)) {
+                return false;
+            }
+            ocl.q.flush();
+            
+            cl::Event done;
+            if (!enqueueReadback(ocl, dt, texture, std::vector<cl::Event>(1, kernels.back()), &done)) {
+                return false;
+            }
+            ocl.qr.flush();
+            
+            err = done.wait();
+            ASSERT_OPENCL(err, "Failed to wait for dilation.");
+            
+            return true;
+        }
+        
+        bool MultiBaker::bakeTextureMap(const Surface &target, Image<unsigned char> &texture, const BakeParameters &params)
+        {
+            if (!_data->hasSource) {
+                BAKE_LOG("No source set.");
+                return false;
+            }
+            
+            if (texture.rows() == 0 || texture.rows() != texture.cols() || texture.channels() != 3) {
+                BAKE_LOG("Texture needs to be a square three channel image.");
+                return false;
+            }
+            
+            if (!validParameters(params)) {
+                return false;
+            }
+            
+            const int nDevices = static_cast<int>(_data->devices.size());
+            
+            // Devices need to agree on what chunks refer to, so tiled dispatch falls back 
+            // on all devices when one does not support it.
+            BakeParameters deviceParams = params;
+            for (int i = 0; i < nDevices; ++i) {
+                if (deviceParams.dispatch == DispatchTiled && !_data->devices[i]->ocl.tilesSupported) {
+                    BAKE_LOG("Device does not support tiled dispatch, falling back to per-texel dispatch.");
+                    deviceParams.dispatch = DispatchPerTexel;
+                }
+            }
+            
+            // Dispatch modes using a texel map chunk texels, tiled dispatch rows of tiles, all others triangles.
+            const bool texelChunks = usesTexelMap(deviceParams.dispatch);
+            const bool tileChunks = deviceParams.dispatch == DispatchTiled;
+            int nItems = static_cast<int>(target.vertexPositions.cols() / 3);
+            if (texelChunks) {
+                nItems = texture.rows() * texture.cols();
+            } else if (tileChunks) {
+                nItems = (texture.rows() + BakeTileSize - 1) / BakeTileSize;
+            }
+            
+            // By default aim for several chunks per device, so that faster devices
+            // pull more work.
+            int chunkSize = _data->chunkSize;
+            if (chunkSize <= 0) {
+                const int minChunkSize = texelChunks ? 4096 : (tileChunks ? 1 : 256);
+                chunkSize = std::max(minChunkSize, (nItems + nDevices * 8 - 1) / (nDevices * 8));
+            }
+            const int nChunks = (nItems + chunkSize - 1) / chunkSize;
+            
+            // First device bakes into the output texture, all others into partial textures.
+            std::vector< std::unique_ptr< Image<unsigned char> > > partials;
+            for (int i = 1; i < nDevices; ++i) {
+                partials.push_back(std::unique_ptr< Image<unsigned char> >(new Image<unsigned char>(texture.rows(), texture.cols(), 3)));
+            }
+            
+            // Partial textures are merged by the coverage masks of the devices, as texels may 
+            // legitimately bake to black. Padding partial textures would let padding of one 
+            // device overwrite texels baked by another, so padding follows the merge.
+            const bool merged = nDevices > 1;
+            const bool padMerged = params.dilation > 0 && merged;
+            std::vector< std::vector<unsigned char> > coverages(merged ? nDevices : 0);
+            
+            std::atomic<int> nextChunk(0);
+            std::vector<char> success(nDevices, 0);
+            std::vector<std::thread> threads;
+            
+            for (int i = 0; i < nDevices; ++i) {
+                Image<unsigned char> &t = (i == 0) ? texture : *partials[i - 1];
+                DeviceSlot &slot = *_data->devices[i];
+                std::vector<unsigned char> *coverage = merged ? &coverages[i] : 0;
+                threads.push_back(std::thread([&, i, coverage]() {
+                    success[i] = bakeChunks(slot, target, t, deviceParams, chunkSize, nChunks, nextChunk, coverage);
+                }));
+            }
+            
+            bool ok = true;
+            for (int i = 0; i < nDevices; ++i) {
+                threads[i].join();
+                ok &= (success[i] != 0);
+            }
+            
+            if (!ok) {
+                BAKE_LOG("Multi device bake failed.");
+                return false;
+            }
+            
+            // Merge partial textures. Devices bake disjoint triangle or texel sets, so each texel
+            // is taken from any partial texture that covered it.
+            for (size_t p = 0; p < partials.size(); ++p) {
+                for (int r = 0; r < texture.rows(); ++r) {
+                    unsigned char *dst = texture.row(r);
+                    const unsigned char *src = partials[p]->row(r);
+                    for (int c = 0; c < texture.cols(); ++c) {
+                        const int texel = r * texture.cols() + c;
+                        if (coverages[p + 1][texel] != 0) {
+                            dst[c*3] = src[c*3];
+                            dst[c*3+1] = src[c*3+1];
+                            dst[c*3+2] = src[c*3+2];
+                            coverages[0][texel] = 1;
+                        }
+                    }
+                }
+            }
+            
+            if (padMerged && !dilateTexture(_data->devices[0]->ocl, texture, coverages[0], params.dilation)) {
+                BAKE_LOG("Failed to pad merged texture.");
+                return false;
+            }
+            
+            return true;
+        }
+        
+        bool bakeTextureMap(const Surface &src, const Surface &target) {
+            Baker b;
+            if (!b.init(SelectHighestThroughput)) {
+                BAKE_LOG("Failed to initialize OpenCL.");
+                return false;
+            }
+            
+            Image<unsigned char> texture(512, 512, 3);
+            if (!b.bakeTextureMap(src, target, texture)) {
+                return false;
+            }
+            
+            cv::Mat m = texture.toOpenCV();
+            cv::flip(m, m, 0);
+            
+            cv::imwrite("input.png", m);
+            cv::imshow("test", m);
+            cv::waitKey();
+            
+            return true;
+        }
+        
+    }
+}
@@ -0,0 +1,287 @@
+// This file is part of gpu-bake, a library for baking texture maps on GPUs.
+//
+// Copyright (C) 2015 Christoph Heindl <christoph.heindl@gmail.com>
+//
+// This Source Code Form is subject to the terms of the BSD 3 license.
+// If a copy of the BSD was not distributed with this file, You can obtain
+// one at http://opensource.org/licenses/BSD-3-Clause.
+
+#include <bake/opencl/buffer_pool.h>
+#include <bake/log.h>
+#include <algorithm>
+#include <list>
+#include <map>
+#include <vector>
+#include <tuple>
+#include <mutex>
+
+namespace bake {
+    namespace opencl {
+        
+        typedef std::pair<cl_mem_flags, ::size_t> BufferKey;
+        typedef std::tuple<cl_mem_flags, ::size_t, ::size_t, cl_channel_order, cl_channel_type> ImageKey;
+        
+        /** Capacity of unused memory when device memory size is unknown. */
+        const ::size_t defaultCapacity = ::size_t(256) << 20;
+        
+        /** Unused buffer or image held by the pool. */
+        struct FreeEntry {
+            bool isImage;
+            BufferKey bufferKey;
+            ImageKey imageKey;
+            cl::Buffer buffer;
+            cl::Image2D image;
+            ::size_t bytes;
+        };
+        
+        /** Free entries in order of release, least recently released first. */
+        typedef std::list<FreeEntry> FreeList;
+        
+        /** Remove entry e from the free entries of its key. */
+        void unlist(std::vector<FreeList::iterator> &entries, FreeList::iterator e)
+        {
+            entries.erase(std::find(entries.begin(), entries.end(), e));
+        }
+        
+        /** 
+            Shared pool state. 
+         
+            Deleters of outstanding handles keep a weak reference, so memory released
+            after the pool died is simply freed.
+         */
+        struct BufferPool::Data {
+            std::mutex lock;
+            cl::Context ctx;
+            ::size_t maxAllocSize;
+            ::size_t capacity;
+            FreeList lru;
+            std::map<BufferKey, std::vector<FreeList::iterator> > freeBuffers;
+            std::map<ImageKey, std::vector<FreeList::iterator> > freeImages;
+            BufferPool::Stats stats;
+            
+            Data()
+            : maxAllocSize(0), capacity(defaultCapacity)
+            {
+                stats.hits = 0;
+                stats.misses = 0;
+                stats.evictions = 0;
+                stats.allocatedBytes = 0;
+                stats.pooledBytes = 0;
+            }
+            
+            /** Take entry e out of the pool. */
+            void take(FreeList::iterator e)
+            {
+                unlist(e->isImage ? freeImages[e->imageKey] : freeBuffers[e->bufferKey], e);
+                stats.pooledBytes -= e->bytes;
+                lru.erase(e);
+            }
+            
+            /** Add released memory to the pool and evict least recently released entries beyond capacity. */
+            void put(const FreeEntry &entry)
+            {
+                FreeList::iterator e = lru.insert(lru.end(), entry);
+                (e->isImage ? freeImages[e->imageKey] : freeBuffers[e->bufferKey]).push_back(e);
+                stats.pooledBytes += e->bytes;
+                
+                while (stats.pooledBytes > capacity && !lru.empty()) {
+                    take(lru.begin());
+                    stats.evictions += 1;
+                }
+            }
+            
+            /** Release all unused memory. */
+            void release()
+            {
+                lru.clear();
+                freeBuffers.clear();
+                freeImages.clear();
+                stats.pooledBytes = 0;
+            }
+        };
+        
+        /** Smallest bucket size in bytes. Also avoids invalid zero sized allocations. */
+        const ::size_t minBucketSize = 4096;
+        
+        /** Largest bucket size in bytes. Larger requests are served exactly, as rounding would waste too much. */
+        const ::size_t maxBucketSize = ::size_t(64) << 20;
+        
+        /** 
+            Size of the allocation serving a request. Falls back to the exact size when the 
+            bucket exceeds maxBucketSize or maxAllocSize, unless maxAllocSize is zero.
+         */
+        ::size_t bucketSize(::size_t size, ::size_t maxAllocSize)
+        {
+            if (size > maxBucketSize) {
+                return size;
+            }
+            
+            ::size_t b = minBucketSize;
+            while (b < size) {
+                b <<= 1;
+            }
+            
+            if (b > maxBucketSize || (maxAllocSize > 0 && b > maxAllocSize)) {
+                return std::max(size, minBucketSize);
+            }
+            return b;
+        }
+        
+        /** Smallest value of a cl_ulong device property over devices in context, or zero when unknown. */
+        ::size_t smallestDeviceInfo(const cl::Context &ctx, cl_device_info name)
+        {
+            std::vector<cl::Device> devices;
+            if (ctx() == 0 || ctx.getInfo(CL_CONTEXT_DEVICES, &devices) != CL_SUCCESS) {
+                return 0;
+            }
+            
+            ::size_t m = 0;
+            for (size_t i = 0; i < devices.size(); ++i) {
+                cl_ulong s = 0;
+                if (devices[i].getInfo(name, &s) == CL_SUCCESS && s > 0) {
+                    m = (m == 0) ? (::size_t)s : std::min(m, (::size_t)s);
+                }
+            }
+            return m;
+        }
+        
+        /** Test if an allocation failed for lack of device memory. */
+        bool outOfMemory(cl_int err)
+        {
+            return err == CL_MEM_OBJECT_ALLOCATION_FAILURE || err == CL_OUT_OF_RESOURCES;
+        }
+        
+        BufferPool::BufferPool()
+        : _data(new Data())
+        {}
+        
+        BufferPool::~BufferPool()
+        {}
+        
+        void BufferPool::setContext(const cl::Context &ctx)
+        {
+            // Memory of outstanding handles belongs to the previous context. A fresh state 
+            // expires the weak references of their deleters, so it is freed on release 
+            // rather than handed out again.
+            std::shared_ptr<Data> d(new Data());
+            {
+                std::lock_guard<std::mutex> guard(_data->lock);
+                d->stats = _data->stats;
+                d->stats.pooledBytes = 0;
+            }
+            
+            d->ctx = ctx;
+            d->maxAllocSize = smallestDeviceInfo(ctx, CL_DEVICE_MAX_MEM_ALLOC_SIZE);
+            const ::size_t memSize = smallestDeviceInfo(ctx, CL_DEVICE_GLOBAL_MEM_SIZE);
+            d->capacity = (memSize > 0) ? memSize / 4 : defaultCapacity;
+            _data = d;
+        }
+        
+        bool BufferPool::acquireBuffer(::size_t size, cl_mem_flags flags, PooledBuffer &b)
+        {
+            std::weak_ptr<Data> pool = _data;
+            
+            std::lock_guard<std::mutex> guard(_data->lock);
+            
+            const BufferKey key(flags, bucketSize(size, _data->maxAllocSize));
+            
+            cl::Buffer buffer;
+            std::vector<FreeList::iterator> &free = _data->freeBuffers[key];
+            if (!free.empty()) {
+                buffer = free.back()->buffer;
+                _data->take(free.back());
+                _data->stats.hits += 1;
+            } else {
+                cl_int err;
+                buffer = cl::Buffer(_data->ctx, flags, key.second, 0, &err);
+                if (outOfMemory(err) && !_data->lru.empty()) {
+                    BAKE_LOG("Releasing unused pooled memory after failed allocation.");
+                    _data->release();
+                    buffer = cl::Buffer(_data->ctx, flags, key.second, 0, &err);
+                }
+                if (err != CL_SUCCESS) {
+                    BAKE_LOG("Failed to allocate pooled buffer of %d bytes : %d", (int)key.second, err);
+                    return false;
+                }
+                _data->stats.misses += 1;
+                _data->stats.allocatedBytes += key.second;
+            }
+            
+            b = PooledBuffer(new cl::Buffer(buffer), [pool, key](cl::Buffer *p) {
+                std::shared_ptr<Data> d = pool.lock();
+                if (d) {
+                    std::lock_guard<std::mutex> guard(d->lock);
+                    FreeEntry e;
+                    e.isImage = false;
+                    e.bufferKey = key;
+                    e.buffer = *p;
+                    e.bytes = key.second;
+                    d->put(e);
+                }
+                delete p;
+            });
+            
+            return true;
+        }
+        
+        bool BufferPool::acquireImage(::size_t width, ::size_t height, const cl::ImageFormat &format, cl_mem_flags flags, PooledImage &i)
+        {
+            const ImageKey key(flags, width, height, format.image_channel_order, format.image_channel_data_type);
+            const ::size_t bytes = width * height * 4;
+            std::weak_ptr<Data> pool = _data;
+            
+            std::lock_guard<std::mutex> guard(_data->lock);
+            
+            cl::Image2D image;
+            std::vector<FreeList::iterator> &free = _data->freeImages[key];
+            if (!free.empty()) {
+                image = free.back()->image;
+                _data->take(free.back());
+                _data->stats.hits += 1;
+            } else {
+                cl_int err;
+                image = cl::Image2D(_data->ctx, flags, cl::ImageFormat(format.image_channel_order, format.image_channel_data_type), width, height, 0, 0, &err);
+                if (outOfMemory(err) && !_data->lru.empty()) {
+                    BAKE_LOG("Releasing unused pooled memory after failed allocation.");
+                    _data->release();
+                    image = cl::Image2D(_data->ctx, flags, cl::ImageFormat(format.image_channel_order, format.image_channel_data_type), width, height, 0, 0, &err);
+                }
+                if (err != CL_SUCCESS) {
+                    BAKE_LOG("Failed to allocate pooled image of %dx%d : %d", (int)width, (int)height, err);
+                    return false;
+                }
+                _data->stats.misses += 1;
+                _data->stats.allocatedBytes += bytes;
+            }
+            
+            i = PooledImage(new cl::Image2D(image), [pool, key, bytes](cl::Image2D *p) {
+                std::shared_ptr<Data> d = pool.lock();
+                if (d) {
+                    std::lock_guard<std::mutex> guard(d->lock);
+                    FreeEntry e;
+                    e.isImage = true;
+                    e.imageKey = key;
+                    e.image = *p;
+                    e.bytes = bytes;
+                    d->put(e);
+                }
+                delete p;
+            });
+            
+            return true;
+        }
+        
+        void BufferPool::clear()
+        {
+            std::lock_guard<std::mutex> guard(_data->lock);
+            _data->release();
+        }
+        
+        BufferPool::Stats BufferPool::stats() const
+        {
+            std::lock_guard<std::mutex> guard(_data->lock);
+            return _data->stats;
+        }
+        
+    }
+}
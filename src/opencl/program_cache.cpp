@@ -0,0 +1,156 @@
+// This file is part of gpu-bake, a library for baking texture maps on GPUs.
+//
+// Copyright (C) 2015 Christoph Heindl <christoph.heindl@gmail.com>
+//
+// This Source Code Form is subject to the terms of the BSD 3 license.
+// If a copy of the BSD was not distributed with this file, You can obtain
+// one at http://opensource.org/licenses/BSD-3-Clause.
+
+#include <bake/opencl/program_cache.h>
+#include <bake/log.h>
+#include <atomic>
+#include <fstream>
+#include <cstdio>
+#include <vector>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace bake {
+    namespace opencl {
+        
+        /** 64bit FNV-1a hash. */
+        void hashFNV(const std::string &s, unsigned long long &h)
+        {
+            for (size_t i = 0; i < s.size(); ++i) {
+                h ^= static_cast<unsigned char>(s[i]);
+                h *= 1099511628211ULL;
+            }
+            // Separator, so that concatenated fields cannot collide.
+            h ^= 0xFF;
+            h *= 1099511628211ULL;
+        }
+        
+        std::string programCacheKey(const cl::Device &d, const std::string &source, const std::string &options)
+        {
+            unsigned long long h = 14695981039346656037ULL;
+            hashFNV(d.getInfo<CL_DEVICE_NAME>(), h);
+            hashFNV(d.getInfo<CL_DEVICE_VENDOR>(), h);
+            hashFNV(d.getInfo<CL_DRIVER_VERSION>(), h);
+            hashFNV(options, h);
+            hashFNV(source, h);
+            
+            char buf[17];
+            sprintf(buf, "%016llx", h);
+            return std::string(buf);
+        }
+        
+        std::string cacheFilePath(const std::string &dir, const std::string &key)
+        {
+            return dir + "/" + key + ".clbin";
+        }
+        
+        std::string uniqueTempPath(const std::string &path)
+        {
+            static std::atomic<unsigned> counter(0);
+#ifdef _WIN32
+            const int pid = _getpid();
+#else
+            const int pid = static_cast<int>(getpid());
+#endif
+            char buf[32];
+            sprintf(buf, ".%d.%u.tmp", pid, counter++);
+            return path + buf;
+        }
+        
+        bool moveIntoPlace(const std::string &tmpPath, const std::string &path)
+        {
+#ifdef _WIN32
+            // Renaming does not replace existing files on Windows.
+            std::remove(path.c_str());
+#endif
+            if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+                BAKE_LOG("Failed to move %s into place.", tmpPath.c_str());
+                std::remove(tmpPath.c_str());
+                return false;
+            }
+            return true;
+        }
+        
+        bool loadCachedProgram(const std::string &dir, const std::string &key,
+                               const cl::Context &ctx, const cl::Device &d, const std::string &options,
+                               cl::Program &prg)
+        {
+            std::ifstream f(cacheFilePath(dir, key).c_str(), std::ios::binary);
+            if (!f) {
+                return false;
+            }
+            
+            std::vector<char> binary((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+            if (binary.empty()) {
+                return false;
+            }
+            
+            std::vector<cl::Device> devs(1, d);
+            cl::Program::Binaries binaries;
+            binaries.push_back(std::make_pair((const void*)&binary[0], binary.size()));
+            
+            std::vector<cl_int> binaryStatus(1, CL_SUCCESS);
+            cl_int err;
+            cl::Program p(ctx, devs, binaries, &binaryStatus, &err);
+            if (err != CL_SUCCESS || binaryStatus[0] != CL_SUCCESS) {
+                BAKE_LOG("Cached OpenCL program %s rejected by driver.", key.c_str());
+                return false;
+            }
+            
+            err = p.build(devs, options.c_str());
+            if (err != CL_SUCCESS) {
+                BAKE_LOG("Failed to build cached OpenCL program %s.", key.c_str());
+                return false;
+            }
+            
+            prg = p;
+            return true;
+        }
+        
+        bool storeCachedProgram(const std::string &dir, const std::string &key, const cl::Program &prg)
+        {
+            std::vector< ::size_t> sizes = prg.getInfo<CL_PROGRAM_BINARY_SIZES>();
+            if (sizes.size() != 1 || sizes[0] == 0) {
+                BAKE_LOG("OpenCL program has no binary to cache.");
+                return false;
+            }
+            
+            std::vector<char> binary(sizes[0]);
+            std::vector<char*> ptrs(1, &binary[0]);
+            if (prg.getInfo(CL_PROGRAM_BINARIES, &ptrs) != CL_SUCCESS) {
+                BAKE_LOG("Failed to query OpenCL program binary.");
+                return false;
+            }
+            
+            // Write to a temporary file of this writer first and rename afterwards, so that
+            // concurrent processes neither interleave writes nor observe partial binaries.
+            const std::string path = cacheFilePath(dir, key);
+            const std::string tmpPath = uniqueTempPath(path);
+            {
+                std::ofstream f(tmpPath.c_str(), std::ios::binary);
+                if (!f) {
+                    BAKE_LOG("Failed to open %s for writing.", tmpPath.c_str());
+                    return false;
+                }
+                f.write(&binary[0], binary.size());
+                if (!f) {
+                    BAKE_LOG("Failed to write %s.", tmpPath.c_str());
+                    f.close();
+                    std::remove(tmpPath.c_str());
+                    return false;
+                }
+            }
+            
+            return moveIntoPlace(tmpPath, path);
+        }
+        
+    }
+}
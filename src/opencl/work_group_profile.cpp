@@ -0,0 +1,78 @@
+// This file is part of gpu-bake, a library for baking texture maps on GPUs.
+//
+// Copyright (C) 2015 Christoph Heindl <christoph.heindl@gmail.com>
+//
+// This Source Code Form is subject to the terms of the BSD 3 license.
+// If a copy of the BSD was not distributed with this file, You can obtain
+// one at http://opensource.org/licenses/BSD-3-Clause.
+
+#include <bake/opencl/work_group_profile.h>
+#include <bake/opencl/program_cache.h>
+#include <bake/log.h>
+#include <fstream>
+#include <cstdio>
+
+namespace bake {
+    namespace opencl {
+        
+        std::string profileFilePath(const std::string &dir, const std::string &key)
+        {
+            return dir + "/" + key + ".wgprofile";
+        }
+        
+        bool loadWorkGroupProfile(const std::string &dir, const std::string &key, WorkGroupProfile &profile)
+        {
+            std::ifstream f(profileFilePath(dir, key).c_str());
+            if (!f) {
+                return false;
+            }
+            
+            // One line per kernel holding its name and local size.
+            WorkGroupProfile p;
+            std::string name;
+            int size;
+            while (f >> name >> size) {
+                if (size < 0) {
+                    BAKE_LOG("Invalid work-group size in profile %s.", key.c_str());
+                    return false;
+                }
+                p[name] = size;
+            }
+            
+            if (!f.eof()) {
+                BAKE_LOG("Failed to parse work-group profile %s.", key.c_str());
+                return false;
+            }
+            
+            profile.swap(p);
+            return true;
+        }
+        
+        bool storeWorkGroupProfile(const std::string &dir, const std::string &key, const WorkGroupProfile &profile)
+        {
+            // Write to a temporary file of this writer first and rename afterwards, so that
+            // concurrent processes neither interleave writes nor observe partial profiles.
+            const std::string path = profileFilePath(dir, key);
+            const std::string tmpPath = uniqueTempPath(path);
+            {
+                std::ofstream f(tmpPath.c_str());
+                if (!f) {
+                    BAKE_LOG("Failed to open %s for writing.", tmpPath.c_str());
+                    return false;
+                }
+                for (auto iter = profile.begin(); iter != profile.end(); ++iter) {
+                    f << iter->first << " " << iter->second << "\n";
+                }
+                if (!f) {
+                    BAKE_LOG("Failed to write %s.", tmpPath.c_str());
+                    f.close();
+                    std::remove(tmpPath.c_str());
+                    return false;
+                }
+            }
+            
+            return moveIntoPlace(tmpPath, path);
+        }
+        
+    }
+}